@@ -1,19 +1,15 @@
 #ifndef ARRAY2D_H
 #define ARRAY2D_H
-#include <QList>
 #include <QSize>
+#include <QVector>
 
 template<class T>
 class Array2D
 {
 public:
   Array2D() : m_width(0), m_height(0) { }
-  Array2D(int width, int height) : m_width(width), m_height(height)
-  {
-    m_data.reserve(m_width * m_height);
-    for(int i = 0; i < (m_width * m_height); ++i)
-      m_data.push_back(T());
-  }
+  Array2D(int width, int height) : m_width(width), m_height(height),
+    m_data(width * height) { }
 
   Array2D(const QSize& size) : Array2D(size.width(), size.height()) { }
 
@@ -32,8 +28,7 @@ public:
 
   void fill(const T& value)
   {
-    for(int i = 0; i < m_data.size(); ++i)
-      m_data[i] = value;
+    m_data.fill(value);
   }
 
   const T& operator()(int x, int y) const
@@ -56,12 +51,16 @@ public:
     return m_data[i];
   }
 
-  const QList<T>& data() const { return m_data; }
+  const QVector<T>& data() const { return m_data; }
+
+  // Contiguous row-major storage of count() values
+  T* bits() { return m_data.data(); }
+  const T* constBits() const { return m_data.constData(); }
 
 private:
   int m_width;
   int m_height;
-  QList<T> m_data;
+  QVector<T> m_data;
 };
 
 #endif // ARRAY2D_H
@@ -0,0 +1,120 @@
+#include <QtAlgorithms>
+#include "BitMask.h"
+#include "BitMaskWriter.h"
+
+namespace
+{
+  // Bytes with their bits in reverse order
+  const struct ReversedBits
+  {
+    uchar bytes[256];
+    ReversedBits()
+    {
+      for(int i = 0; i < 256; ++i)
+      {
+        uchar b = 0;
+        for(int bit = 0; bit < 8; ++bit)
+          if(i & (1 << bit)) b |= 0x80 >> bit;
+        bytes[i] = b;
+      }
+    }
+  } reversedBits;
+}
+
+BitMask::BitMask() : m_width(0), m_height(0), m_wordsPerLine(0)
+{
+}
+
+BitMask::BitMask(int width, int height) :
+  m_width(width), m_height(height), m_wordsPerLine((width + 63) / 64),
+  m_words(m_wordsPerLine * height, 0)
+{
+}
+
+BitMask::BitMask(const QSize &size) : BitMask(size.width(), size.height())
+{
+}
+
+void BitMask::fill(bool value)
+{
+  m_words.fill(value ? ~quint64(0) : 0);
+  if(value) clearPadding();
+}
+
+qint64 BitMask::count() const
+{
+  qint64 total = 0;
+  for(quint64 word: m_words) total += qPopulationCount(word);
+  return total;
+}
+
+BitMask &BitMask::operator|=(const BitMask &other)
+{
+  if(other.size() != size()) return *this;
+
+  quint64 *words = m_words.data();
+  const quint64 *otherWords = other.m_words.constData();
+  for(int i = 0; i < m_words.count(); ++i) words[i] |= otherWords[i];
+
+  return *this;
+}
+
+BitMask &BitMask::operator&=(const BitMask &other)
+{
+  if(other.size() != size()) return *this;
+
+  quint64 *words = m_words.data();
+  const quint64 *otherWords = other.m_words.constData();
+  for(int i = 0; i < m_words.count(); ++i) words[i] &= otherWords[i];
+
+  return *this;
+}
+
+void BitMask::invert()
+{
+  quint64 *words = m_words.data();
+  for(int i = 0; i < m_words.count(); ++i) words[i] = ~words[i];
+  clearPadding();
+}
+
+QImage BitMask::toImage() const
+{
+  QImage image(size(), QImage::Format_Mono);
+  image.setColorCount(2);
+  image.setColor(0, qRgb(0, 0, 0));
+  image.setColor(1, qRgb(255, 255, 255));
+
+  for(int y = 0; y < m_height; ++y)
+    packRow(y, false, image.scanLine(y));
+
+  return image;
+}
+
+void BitMask::packRow(int y, bool invert, uchar *bytes) const
+{
+  const quint64 *words = scanLine(y);
+  const uchar flip = invert ? 0xff : 0;
+  const int count = (m_width + 7) / 8;
+  for(int i = 0; i < count; ++i)
+    bytes[i] = reversedBits.bytes[uchar(words[i / 8] >> (8 * (i % 8)))] ^ flip;
+}
+
+bool BitMask::save(const QString &path, bool packBits) const
+{
+  if(isNull()) return false;
+
+  if(!BitMaskWriter::isSupported(path)) return toImage().save(path);
+
+  BitMaskWriter writer;
+  return writer.open(path, size(), packBits) && writer.write(*this)
+      && writer.close();
+}
+
+void BitMask::clearPadding()
+{
+  int bits = m_width % 64;
+  if(bits == 0) return;
+
+  const quint64 keep = (quint64(1) << bits) - 1;
+  for(int y = 0; y < m_height; ++y) scanLine(y)[m_wordsPerLine - 1] &= keep;
+}
@@ -0,0 +1,83 @@
+#ifndef BITMASK_H
+#define BITMASK_H
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <QVector>
+
+// Binary image of one bit per pixel.  Each row is padded to whole 64-bit
+// words so rows can be written by separate threads and combined a word at a
+// time.  Pixel x of a row is bit x % 64, least significant first, of word
+// x / 64.
+class BitMask
+{
+public:
+  BitMask();
+  BitMask(int width, int height);
+  explicit BitMask(const QSize& size);
+
+  int width()  const { return m_width;  }
+  int height() const { return m_height; }
+  QSize size() const { return QSize(m_width, m_height); }
+
+  bool isNull() const { return m_words.isEmpty(); }
+
+  int wordsPerLine() const { return m_wordsPerLine; }
+
+  bool testBit(int x, int y) const
+  {
+    return (scanLine(y)[x >> 6] >> (x & 63)) & 1;
+  }
+
+  void setBit(int x, int y)
+  {
+    scanLine(y)[x >> 6] |= quint64(1) << (x & 63);
+  }
+
+  void clearBit(int x, int y)
+  {
+    scanLine(y)[x >> 6] &= ~(quint64(1) << (x & 63));
+  }
+
+  // Words of row y; padding bits past the width are always clear
+  quint64* scanLine(int y) { return m_words.data() + y * m_wordsPerLine; }
+  const quint64* scanLine(int y) const
+  {
+    return m_words.constData() + y * m_wordsPerLine;
+  }
+
+  void fill(bool value);
+
+  // Number of set pixels
+  qint64 count() const;
+
+  // Combine masks of equal size pixel by pixel
+  BitMask& operator|=(const BitMask& other);
+  BitMask& operator&=(const BitMask& other);
+  void invert();
+
+  // Converts row y to bytes with the leftmost pixel in the most significant
+  // bit, as PBM, PNG and TIFF expect.  invert flips every pixel.
+  void packRow(int y, bool invert, uchar *bytes) const;
+
+  // Monochrome image with set pixels white
+  QImage toImage() const;
+
+  // Writes the mask with set pixels white.  Binary PBM, 1-bit TIFF and
+  // 1-bit grayscale PNG are encoded straight from the packed rows by
+  // BitMaskWriter, chosen by suffix; other formats go through toImage().
+  // packBits compresses TIFF rows with PackBits run-length encoding.
+  // Returns false on failure.
+  bool save(const QString& path, bool packBits = false) const;
+
+private:
+  // Clears the bits past the width in the last word of each row
+  void clearPadding();
+
+  int m_width;
+  int m_height;
+  int m_wordsPerLine;
+  QVector<quint64> m_words;
+};
+
+#endif // BITMASK_H
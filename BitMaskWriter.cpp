@@ -0,0 +1,443 @@
+#include <QFileInfo>
+#include <QtEndian>
+#include "BitMaskWriter.h"
+#include "ParallelFor.h"
+
+#include <cstring>
+#include <zlib.h>
+
+namespace
+{
+  // Rows encoded together by one thread and written as one PNG chunk or
+  // TIFF strip
+  const int stripRows = 256;
+
+  // Bytes of a row with eight pixels per byte
+  int rowBytes(int width)
+  {
+    return (width + 7) / 8;
+  }
+
+  void appendBigEndian(QByteArray *data, quint32 value)
+  {
+    uchar bytes[4];
+    qToBigEndian(value, bytes);
+    data->append(reinterpret_cast<const char*>(bytes), 4);
+  }
+
+  template<typename T>
+  void appendLittleEndian(QByteArray *data, T value)
+  {
+    uchar bytes[sizeof(T)];
+    qToLittleEndian(value, bytes);
+    data->append(reinterpret_cast<const char*>(bytes), sizeof(T));
+  }
+
+  // Appends count bytes compressed with PackBits.  Runs of two or more equal
+  // bytes are replicated; other bytes are copied literally.
+  void packBits(const uchar *bytes, int count, QByteArray *data)
+  {
+    int i = 0;
+    while(i < count)
+    {
+      int run = 1;
+      while(i + run < count && run < 128 && bytes[i + run] == bytes[i]) ++run;
+
+      if(run > 1)
+      {
+        data->append(char(1 - run));
+        data->append(char(bytes[i]));
+        i += run;
+        continue;
+      }
+
+      // Literal bytes up to the next run of three
+      int start = i;
+      while(i < count && i - start < 128)
+      {
+        if(i + 2 < count && bytes[i] == bytes[i + 1]
+           && bytes[i] == bytes[i + 2])
+        {
+          break;
+        }
+        ++i;
+      }
+      data->append(char(i - start - 1));
+      data->append(reinterpret_cast<const char*>(bytes + start), i - start);
+    }
+  }
+
+  // Copies count rows of source starting at row begin to target at row to
+  void copyRows(const BitMask& source, int begin, int count, BitMask *target,
+                int to)
+  {
+    const size_t bytes = size_t(source.wordsPerLine()) * sizeof(quint64);
+    for(int y = 0; y < count; ++y)
+      std::memcpy(target->scanLine(to + y), source.scanLine(begin + y), bytes);
+  }
+}
+
+BitMaskWriter::BitMaskWriter() :
+  m_format(PBM), m_packBits(false), m_failed(false), m_georeferenced(false),
+  m_pixelSize(0.0), m_rows(0), m_checksum(0), m_position(0)
+{
+}
+
+bool BitMaskWriter::isSupported(const QString &path)
+{
+  QString suffix = QFileInfo(path).suffix().toLower();
+  return suffix == "pbm" || suffix == "png" || suffix == "tif"
+      || suffix == "tiff";
+}
+
+void BitMaskWriter::setGeoreference(const QPointF &topLeft, double pixelSize)
+{
+  m_georeferenced = true;
+  m_topLeft = topLeft;
+  m_pixelSize = pixelSize;
+}
+
+bool BitMaskWriter::open(const QString &path, const QSize &size,
+                         bool packBits)
+{
+  if(m_file.isOpen() || !isSupported(path) || size.isEmpty()) return false;
+
+  QString suffix = QFileInfo(path).suffix().toLower();
+  m_format = suffix == "pbm" ? PBM : (suffix == "png" ? PNG : TIFF);
+  m_size = size;
+  m_packBits = packBits;
+  m_failed = false;
+  m_pending = BitMask();
+  m_rows = 0;
+  m_checksum = quint32(adler32(0, Z_NULL, 0));
+  m_offsets.clear();
+  m_counts.clear();
+
+  // Written to a temporary file and renamed on commit
+  m_file.setFileName(path);
+  if(!m_file.open(QIODevice::WriteOnly)) return false;
+
+  if(m_format == PBM)
+  {
+    QByteArray header("P4\n");
+    header += QByteArray::number(size.width()) + " "
+        + QByteArray::number(size.height()) + "\n";
+    m_file.write(header);
+  }
+  else if(m_format == PNG)
+  {
+    m_file.write("\x89PNG\r\n\x1a\n", 8);
+
+    // 1-bit grayscale, deflate, no interlacing
+    QByteArray header;
+    appendBigEndian(&header, size.width());
+    appendBigEndian(&header, size.height());
+    header.append("\x01\x00\x00\x00\x00", 5);
+    writePNGChunk("IHDR", header);
+  }
+  else
+  {
+    // The directory offset is filled in by close()
+    QByteArray header("II", 2);
+    appendLittleEndian<quint16>(&header, 42);
+    appendLittleEndian<quint32>(&header, 0);
+    m_file.write(header);
+    m_position = header.size();
+  }
+
+  return true;
+}
+
+bool BitMaskWriter::write(const BitMask &band)
+{
+  if(!m_file.isOpen() || m_failed) return false;
+
+  if(band.width() != m_size.width()
+     || m_rows + m_pending.height() + band.height() > m_size.height())
+  {
+    m_failed = true;
+    return false;
+  }
+
+  // Rows left over from the previous band go first
+  if(m_pending.height() == 0)
+  {
+    m_pending = band;
+  }
+  else
+  {
+    BitMask rows(m_size.width(), m_pending.height() + band.height());
+    copyRows(m_pending, 0, m_pending.height(), &rows, 0);
+    copyRows(band, 0, band.height(), &rows, m_pending.height());
+    m_pending = rows;
+  }
+
+  if(!flush()) m_failed = true;
+
+  return !m_failed;
+}
+
+bool BitMaskWriter::close()
+{
+  if(!m_file.isOpen()) return false;
+
+  if(m_failed || m_rows != m_size.height())
+  {
+    m_file.cancelWriting();
+    m_file.commit();
+    return false;
+  }
+
+  if(m_format == PNG)
+  {
+    writePNGChunk("IEND", QByteArray());
+  }
+  else if(m_format == TIFF)
+  {
+    // Layout after the strips: strip offsets and byte counts, resolution,
+    // any GeoTIFF values, then the directory
+    const int strips = m_offsets.count();
+    if(m_position & 1) m_file.write("", 1);
+    const quint32 offsetsOffset = m_position + (m_position & 1);
+
+    QByteArray tables;
+    for(quint32 offset: m_offsets) appendLittleEndian<quint32>(&tables, offset);
+    const quint32 countsOffset = offsetsOffset + tables.size();
+    for(quint32 count: m_counts) appendLittleEndian<quint32>(&tables, count);
+    const quint32 resolutionOffset = offsetsOffset + tables.size();
+    appendLittleEndian<quint32>(&tables, 72);
+    appendLittleEndian<quint32>(&tables, 1);
+
+    // Pixel scale, then the raster corner (0, 0) tied to its map position
+    auto appendDouble = [&](double value)
+    {
+      quint64 bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      appendLittleEndian<quint64>(&tables, bits);
+    };
+    const quint32 scaleOffset = offsetsOffset + tables.size();
+    const quint32 tiepointOffset = scaleOffset + 3 * sizeof(double);
+    if(m_georeferenced)
+    {
+      appendDouble(m_pixelSize);
+      appendDouble(m_pixelSize);
+      appendDouble(0.0);
+      appendDouble(0.0);
+      appendDouble(0.0);
+      appendDouble(0.0);
+      appendDouble(m_topLeft.x());
+      appendDouble(m_topLeft.y());
+      appendDouble(0.0);
+    }
+    const quint32 directoryOffset = offsetsOffset + tables.size();
+
+    // Directory entries in ascending tag order
+    enum { Short = 3, Long = 4, Rational = 5, Double = 12 };
+    QByteArray directory;
+    auto entry = [&](quint16 tag, quint16 type, quint32 count, quint32 value)
+    {
+      appendLittleEndian<quint16>(&directory, tag);
+      appendLittleEndian<quint16>(&directory, type);
+      appendLittleEndian<quint32>(&directory, count);
+      // Short values are left-justified in the value field
+      if(type == Short && count == 1)
+      {
+        appendLittleEndian<quint16>(&directory, quint16(value));
+        appendLittleEndian<quint16>(&directory, 0);
+      }
+      else
+      {
+        appendLittleEndian<quint32>(&directory, value);
+      }
+    };
+
+    appendLittleEndian<quint16>(&directory, m_georeferenced ? 14 : 12);
+    entry(256, Long, 1, m_size.width());
+    entry(257, Long, 1, m_size.height());
+    entry(258, Short, 1, 1);
+    // PackBits or no compression
+    entry(259, Short, 1, m_packBits ? 32773 : 1);
+    // BlackIsZero, so set pixels are white
+    entry(262, Short, 1, 1);
+    entry(273, Long, strips, strips == 1 ? m_offsets.first() : offsetsOffset);
+    entry(277, Short, 1, 1);
+    entry(278, Long, 1, stripRows);
+    entry(279, Long, strips, strips == 1 ? m_counts.first() : countsOffset);
+    entry(282, Rational, 1, resolutionOffset);
+    entry(283, Rational, 1, resolutionOffset);
+    // No absolute resolution unit
+    entry(296, Short, 1, 1);
+    if(m_georeferenced)
+    {
+      entry(33550, Double, 3, scaleOffset);
+      entry(33922, Double, 6, tiepointOffset);
+    }
+    appendLittleEndian<quint32>(&directory, 0);
+
+    m_file.write(tables);
+    m_file.write(directory);
+
+    QByteArray offset;
+    appendLittleEndian<quint32>(&offset, directoryOffset);
+    m_file.seek(4);
+    m_file.write(offset);
+  }
+
+  return m_file.commit();
+}
+
+bool BitMaskWriter::flush()
+{
+  const int pending = m_pending.height();
+  const bool complete = m_rows + pending == m_size.height();
+  const int strips = complete ? (pending + stripRows - 1) / stripRows
+                              : pending / stripRows;
+  if(strips == 0) return true;
+
+  QVector<Strip> encoded(strips);
+  Strip *strip = encoded.data();
+  parallelFor(strips, 1, [&](int first, int last)
+  {
+    for(int s = first; s < last; ++s)
+    {
+      int begin = s * stripRows;
+      int end = qMin(begin + stripRows, pending);
+      strip[s] = encode(begin, end, complete && s == strips - 1);
+    }
+  });
+
+  for(int s = 0; s < strips; ++s)
+  {
+    const Strip &data = encoded.at(s);
+    if(data.data.isEmpty()) return false;
+
+    if(m_format == PBM)
+    {
+      m_file.write(data.data);
+    }
+    else if(m_format == PNG)
+    {
+      QByteArray chunk;
+      // zlib header for deflate with a 32K window at the default level
+      if(m_rows == 0 && s == 0) chunk.append("\x78\x9c", 2);
+      chunk.append(data.data);
+
+      m_checksum = quint32(adler32_combine(m_checksum, data.checksum,
+                                           data.length));
+      if(complete && s == strips - 1) appendBigEndian(&chunk, m_checksum);
+
+      writePNGChunk("IDAT", chunk);
+    }
+    else
+    {
+      // Offsets are 32-bit
+      if(quint64(m_position) + data.data.size() > 0xffffffffu) return false;
+
+      m_offsets.push_back(m_position);
+      m_counts.push_back(data.data.size());
+      m_file.write(data.data);
+      m_position += data.data.size();
+    }
+  }
+
+  // Rows short of a strip wait for the next band
+  const int written = qMin(strips * stripRows, pending);
+  BitMask rest(m_size.width(), pending - written);
+  copyRows(m_pending, written, rest.height(), &rest, 0);
+  m_pending = rest;
+  m_rows += written;
+
+  return true;
+}
+
+BitMaskWriter::Strip BitMaskWriter::encode(int begin, int end,
+                                           bool last) const
+{
+  const int width = m_size.width();
+  const int bytes = rowBytes(width);
+
+  Strip strip;
+  strip.checksum = 0;
+  strip.length = 0;
+
+  if(m_format == PBM)
+  {
+    // PBM stores black as 1
+    strip.data.resize((end - begin) * bytes);
+    uchar *rows = reinterpret_cast<uchar*>(strip.data.data());
+    for(int y = begin; y < end; ++y)
+      m_pending.packRow(y, true, rows + (y - begin) * bytes);
+  }
+  else if(m_format == TIFF)
+  {
+    // PackBits runs never cross rows
+    if(!m_packBits) strip.data.resize((end - begin) * bytes);
+    QVector<uchar> row(bytes);
+    for(int y = begin; y < end; ++y)
+    {
+      if(m_packBits)
+      {
+        m_pending.packRow(y, false, row.data());
+        packBits(row.constData(), bytes, &strip.data);
+      }
+      else
+      {
+        m_pending.packRow(y, false, reinterpret_cast<uchar*>(strip.data.data())
+                          + (y - begin) * bytes);
+      }
+    }
+  }
+  else
+  {
+    // Each row starts with filter type 0
+    QByteArray raw((end - begin) * (bytes + 1), 0);
+    uchar *row = reinterpret_cast<uchar*>(raw.data());
+    for(int y = begin; y < end; ++y, row += bytes + 1)
+      m_pending.packRow(y, false, row + 1);
+
+    // Strips are deflated independently and concatenated as one zlib
+    // stream; all but the last end byte-aligned with a full flush, so no
+    // strip refers back into another
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      return strip;
+    }
+
+    // Room for the flush marker beyond the bound for finishing
+    QByteArray output(int(deflateBound(&stream, raw.size())) + 16, 0);
+    stream.next_in = reinterpret_cast<Bytef*>(raw.data());
+    stream.avail_in = uInt(raw.size());
+    stream.next_out = reinterpret_cast<Bytef*>(output.data());
+    stream.avail_out = uInt(output.size());
+
+    int result = deflate(&stream, last ? Z_FINISH : Z_FULL_FLUSH);
+    bool deflated = result == (last ? Z_STREAM_END : Z_OK)
+        && stream.avail_in == 0;
+    output.resize(int(stream.total_out));
+    deflateEnd(&stream);
+    if(!deflated) return strip;
+
+    strip.data = output;
+    strip.checksum = quint32(adler32(adler32(0, Z_NULL, 0),
+        reinterpret_cast<const Bytef*>(raw.constData()), uInt(raw.size())));
+    strip.length = raw.size();
+  }
+
+  return strip;
+}
+
+void BitMaskWriter::writePNGChunk(const char *type, const QByteArray &data)
+{
+  QByteArray chunk;
+  appendBigEndian(&chunk, data.size());
+  chunk.append(type, 4);
+  chunk.append(data);
+
+  uLong crc = crc32(0, reinterpret_cast<const Bytef*>(chunk.constData() + 4),
+                    uInt(chunk.size() - 4));
+  appendBigEndian(&chunk, quint32(crc));
+  m_file.write(chunk);
+}
@@ -0,0 +1,92 @@
+#ifndef BITMASKWRITER_H
+#define BITMASKWRITER_H
+#include <QByteArray>
+#include <QPointF>
+#include <QSaveFile>
+#include <QSize>
+#include <QString>
+#include <QVector>
+#include "BitMask.h"
+
+// Writes a binary image band by band, so the whole mask never needs to be
+// in memory.  Binary PBM, 1-bit grayscale PNG and 1-bit TIFF are chosen by
+// suffix, with set pixels white.  Rows are encoded in strips of 256 by
+// parallel threads as soon as a strip is complete; leftover rows wait for
+// the next band.
+class BitMaskWriter
+{
+public:
+  BitMaskWriter();
+
+  // Whether the suffix of path names a supported format
+  static bool isSupported(const QString& path);
+
+  // Tags TIFF output with the map position of the top left corner of the
+  // image and the size of a pixel, as GeoTIFF model tiepoint and pixel
+  // scale.  Other formats rely on a world file.
+  void setGeoreference(const QPointF& topLeft, double pixelSize);
+
+  // Starts an image of size.  packBits compresses TIFF rows with PackBits
+  // run-length encoding.  Returns false on failure.
+  bool open(const QString& path, const QSize& size, bool packBits = false);
+
+  // Appends the rows of band, which must be as wide as the image.  Returns
+  // false on failure or if band runs past the bottom of the image.
+  bool write(const BitMask& band);
+
+  // Finishes the file once every row has been written; the file is only
+  // renamed into place if this succeeds
+  bool close();
+
+private:
+  Q_DISABLE_COPY(BitMaskWriter)
+
+  enum Format
+  {
+    PBM,
+    PNG,
+    TIFF
+  };
+
+  // Encoded rows of one strip
+  struct Strip
+  {
+    QByteArray data;
+    // Adler-32 and length of the raw PNG rows
+    quint32 checksum;
+    quint32 length;
+  };
+
+  // Encodes and writes whole strips of the pending rows, or every pending
+  // row if the image is complete
+  bool flush();
+
+  Strip encode(int begin, int end, bool last) const;
+
+  void writePNGChunk(const char *type, const QByteArray& data);
+
+  QSaveFile m_file;
+  Format m_format;
+  QSize m_size;
+  bool m_packBits;
+  bool m_failed;
+
+  bool m_georeferenced;
+  QPointF m_topLeft;
+  double m_pixelSize;
+
+  // Rows waiting for a whole strip
+  BitMask m_pending;
+  // Rows written so far
+  int m_rows;
+
+  // Running PNG checksum of the raw rows
+  quint32 m_checksum;
+
+  // TIFF strip offsets and byte counts, in file order
+  QVector<quint32> m_offsets;
+  QVector<quint32> m_counts;
+  quint32 m_position;
+};
+
+#endif // BITMASKWRITER_H
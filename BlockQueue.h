@@ -0,0 +1,54 @@
+#ifndef BLOCKQUEUE_H
+#define BLOCKQUEUE_H
+#include <QSemaphore>
+#include <QVector>
+
+// Bounded queue handing items from one producer thread to one consumer
+// thread.  Slots of a ring buffer are passed between the threads by two
+// semaphores, so neither side locks the buffer itself.  push() blocks while
+// the queue is full and pop() while it is empty.
+template<typename T>
+class BlockQueue
+{
+public:
+  explicit BlockQueue(int capacity) :
+    m_slots(capacity), m_buffer(m_slots.data()), m_free(capacity), m_used(0),
+    m_head(0), m_tail(0)
+  {
+  }
+
+  void push(const T& item)
+  {
+    m_free.acquire();
+    m_buffer[m_tail] = item;
+    m_tail = (m_tail + 1) % m_slots.count();
+    m_used.release();
+  }
+
+  T pop()
+  {
+    m_used.acquire();
+    T item = m_buffer[m_head];
+    // Release the slot's reference so consumed items are freed promptly
+    m_buffer[m_head] = T();
+    m_head = (m_head + 1) % m_slots.count();
+    m_free.release();
+
+    return item;
+  }
+
+private:
+  Q_DISABLE_COPY(BlockQueue)
+
+  QVector<T> m_slots;
+  // Taken once so the threads never call into the vector concurrently
+  T *m_buffer;
+  QSemaphore m_free;
+  QSemaphore m_used;
+
+  // Only touched by the consumer and the producer respectively
+  int m_head;
+  int m_tail;
+};
+
+#endif // BLOCKQUEUE_H
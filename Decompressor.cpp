@@ -0,0 +1,374 @@
+#include <QtConcurrent>
+#include <QtEndian>
+#include "Decompressor.h"
+#include "ParallelFor.h"
+
+#include <cstring>
+#include <zlib.h>
+#include <zstd.h>
+
+namespace
+{
+  // Size of blocks from sequential decompression
+  const int blockSize = 4 << 20;
+
+  // Decompressed size gathered into one block from parallel pieces
+  const qint64 batchSize = 16 << 20;
+
+  // Larger pieces are decompressed sequentially
+  const qint64 maximumPieceSize = 256 << 20;
+
+  // Input handed to zlib at once; its sizes are 32-bit
+  const qint64 maximumInflateInput = 1 << 30;
+
+  // Whether size bytes at data are all zero, as the padding some tools
+  // append after the last gzip member; true for no bytes
+  bool isZeroPadding(const uchar *data, qint64 size)
+  {
+    for(qint64 i = 0; i < size; ++i)
+      if(data[i] != 0) return false;
+    return true;
+  }
+
+  // Inflates one raw deflate stream of a BGZF block
+  bool inflatePiece(const uchar *source, qint64 size, uchar *destination,
+                    qint64 outputSize)
+  {
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) return false;
+
+    stream.next_in = const_cast<Bytef*>(source);
+    stream.avail_in = uInt(size);
+    stream.next_out = destination;
+    stream.avail_out = uInt(outputSize);
+
+    int result = inflate(&stream, Z_FINISH);
+    bool ok = result == Z_STREAM_END && qint64(stream.total_out) == outputSize;
+    inflateEnd(&stream);
+
+    return ok;
+  }
+}
+
+Decompressor::Format Decompressor::format(const QString &path)
+{
+  QFile file(path);
+  if(!file.open(QIODevice::ReadOnly)) return Uncompressed;
+
+  QByteArray magic = file.read(4);
+  if(magic.startsWith("\x1f\x8b")) return Gzip;
+  if(magic == QByteArray("\x28\xb5\x2f\xfd", 4)) return Zstd;
+  return Uncompressed;
+}
+
+Decompressor::Decompressor(const QString &path) :
+  m_file(path), m_format(Uncompressed), m_data(0), m_size(0), m_queue(4),
+  m_canceled(0), m_started(false), m_finished(false)
+{
+  m_pool.setMaxThreadCount(1);
+}
+
+Decompressor::~Decompressor()
+{
+  if(!m_started) return;
+
+  // Unblock the producer by draining the queue until its final block
+  m_canceled.storeRelease(1);
+  while(!m_finished) read();
+  m_producer.waitForFinished();
+}
+
+bool Decompressor::start()
+{
+  m_format = format(m_file.fileName());
+  if(m_format == Uncompressed)
+  {
+    m_errorString = "Not a gzip or zstd file";
+    return false;
+  }
+
+  if(!m_file.open(QIODevice::ReadOnly))
+  {
+    m_errorString = "Unable to open file";
+    return false;
+  }
+
+  m_size = m_file.size();
+  m_data = m_file.map(0, m_size);
+  if(!m_data)
+  {
+    m_errorString = "Unable to map file";
+    return false;
+  }
+
+  m_started = true;
+  m_producer = QtConcurrent::run(&m_pool, [this]()
+  {
+    QVector<Piece> pieces;
+    bool split = m_format == Zstd ? findZstdFrames(&pieces)
+                                  : findGzipBlocks(&pieces);
+
+    bool ok;
+    if(split) ok = decompressPieces(pieces);
+    else if(m_format == Zstd) ok = decompressZstd();
+    else ok = inflateGzip();
+
+    if(!ok && !m_canceled.loadAcquire() && m_errorString.isEmpty())
+      m_errorString = "Corrupt compressed data";
+
+    // Empty block marks the end
+    m_queue.push(QByteArray());
+  });
+
+  return true;
+}
+
+QByteArray Decompressor::read()
+{
+  if(m_finished) return QByteArray();
+
+  QByteArray block = m_queue.pop();
+  if(block.isEmpty()) m_finished = true;
+  return block;
+}
+
+bool Decompressor::deliver(const QByteArray &block)
+{
+  if(m_canceled.loadAcquire()) return false;
+
+  m_queue.push(block);
+  return true;
+}
+
+bool Decompressor::findZstdFrames(QVector<Piece> *pieces) const
+{
+  for(qint64 offset = 0; offset < m_size;)
+  {
+    size_t size = ZSTD_findFrameCompressedSize(m_data + offset,
+                                               m_size - offset);
+    unsigned long long outputSize =
+        ZSTD_getFrameContentSize(m_data + offset, m_size - offset);
+    if(ZSTD_isError(size) || outputSize == ZSTD_CONTENTSIZE_UNKNOWN
+       || outputSize == ZSTD_CONTENTSIZE_ERROR
+       || outputSize > quint64(maximumPieceSize))
+    {
+      return false;
+    }
+
+    Piece piece = { offset, qint64(size), qint64(outputSize), 0 };
+    pieces->push_back(piece);
+    offset += size;
+  }
+
+  return pieces->count() > 1;
+}
+
+bool Decompressor::findGzipBlocks(QVector<Piece> *pieces) const
+{
+  // BGZF members carry their compressed size in a "BC" extra field first
+  // in the header, and end with the CRC-32 and size of their output
+  for(qint64 offset = 0; offset < m_size;)
+  {
+    const uchar *member = m_data + offset;
+    if(isZeroPadding(member, m_size - offset)) break;
+    if(m_size - offset < 28 || member[0] != 0x1f || member[1] != 0x8b
+       || member[2] != 8 || !(member[3] & 4) || member[12] != 'B'
+       || member[13] != 'C' || qFromLittleEndian<quint16>(member + 14) != 2)
+    {
+      return false;
+    }
+
+    int extraSize = qFromLittleEndian<quint16>(member + 10);
+    qint64 size = qFromLittleEndian<quint16>(member + 16) + 1;
+    if(size < extraSize + 20 || offset + size > m_size) return false;
+
+    Piece piece;
+    piece.offset = offset + 12 + extraSize;
+    piece.size = size - extraSize - 20;
+    piece.crc = qFromLittleEndian<quint32>(member + size - 8);
+    piece.outputSize = qFromLittleEndian<quint32>(member + size - 4);
+    pieces->push_back(piece);
+    offset += size;
+  }
+
+  return pieces->count() > 1;
+}
+
+bool Decompressor::decompressPieces(const QVector<Piece> &pieces)
+{
+  for(int first = 0; first < pieces.count();)
+  {
+    // Batch of consecutive pieces and their positions in the block
+    QVector<qint64> starts;
+    starts.push_back(0);
+    int last = first;
+    while(last < pieces.count() && (last == first
+                                    || starts.last() < batchSize))
+    {
+      starts.push_back(starts.last() + pieces.at(last).outputSize);
+      ++last;
+    }
+
+    QByteArray block(int(starts.last()), Qt::Uninitialized);
+    uchar *output = reinterpret_cast<uchar*>(block.data());
+    QAtomicInt failed(0);
+
+    // This thread works through ranges itself, so the batch still finishes
+    // when consumers hold every thread of the global pool
+    parallelFor(last - first, 1, [&](int begin, int end)
+    {
+      for(int i = begin; i < end; ++i)
+      {
+        const Piece &piece = pieces.at(first + i);
+        uchar *destination = output + starts.at(i);
+        if(piece.outputSize == 0) continue;
+
+        bool ok;
+        if(m_format == Zstd)
+        {
+          size_t size = ZSTD_decompress(destination, piece.outputSize,
+                                        m_data + piece.offset, piece.size);
+          ok = !ZSTD_isError(size) && qint64(size) == piece.outputSize;
+        }
+        else
+        {
+          ok = inflatePiece(m_data + piece.offset, piece.size, destination,
+                            piece.outputSize)
+              && crc32(0, destination, uInt(piece.outputSize)) == piece.crc;
+        }
+
+        if(!ok) failed.storeRelease(1);
+      }
+    });
+
+    if(failed.loadAcquire()) return false;
+    if(!block.isEmpty() && !deliver(block)) return false;
+
+    first = last;
+  }
+
+  return true;
+}
+
+bool Decompressor::inflateGzip()
+{
+  z_stream stream;
+  std::memset(&stream, 0, sizeof(stream));
+  // Accept the gzip wrapper
+  if(inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) return false;
+
+  qint64 consumed = 0;
+  bool done = false;
+  bool ok = true;
+
+  while(!done && ok)
+  {
+    QByteArray block(blockSize, Qt::Uninitialized);
+    stream.next_out = reinterpret_cast<Bytef*>(block.data());
+    stream.avail_out = blockSize;
+
+    while(stream.avail_out > 0)
+    {
+      if(stream.avail_in == 0)
+      {
+        if(consumed == m_size)
+        {
+          // Input ended inside a member
+          m_errorString = "Truncated gzip file";
+          ok = false;
+          break;
+        }
+
+        qint64 size = qMin(m_size - consumed, maximumInflateInput);
+        stream.next_in = const_cast<Bytef*>(m_data + consumed);
+        stream.avail_in = uInt(size);
+        consumed += size;
+      }
+
+      int result = inflate(&stream, Z_NO_FLUSH);
+      if(result == Z_STREAM_END)
+      {
+        // Look at the rest of the file, not just the input handed to zlib,
+        // which may end at a chunk boundary
+        const qint64 next = consumed - stream.avail_in;
+        if(isZeroPadding(m_data + next, m_size - next))
+        {
+          done = true;
+          break;
+        }
+
+        // Concatenated members continue the data
+        if(m_size - next < 2 || m_data[next] != 0x1f
+           || m_data[next + 1] != 0x8b)
+        {
+          m_errorString = "Trailing garbage after gzip data";
+          ok = false;
+          break;
+        }
+        inflateReset(&stream);
+      }
+      else if(result != Z_OK)
+      {
+        ok = false;
+        break;
+      }
+    }
+
+    block.resize(blockSize - stream.avail_out);
+    if(ok && !block.isEmpty() && !deliver(block)) ok = false;
+  }
+
+  inflateEnd(&stream);
+  return ok;
+}
+
+bool Decompressor::decompressZstd()
+{
+  ZSTD_DStream *stream = ZSTD_createDStream();
+  if(!stream) return false;
+  ZSTD_initDStream(stream);
+
+  ZSTD_inBuffer input = { m_data, size_t(m_size), 0 };
+  // Nonzero while a frame is incomplete
+  size_t hint = 1;
+  bool done = false;
+  bool ok = true;
+
+  while(!done && ok)
+  {
+    QByteArray block(blockSize, Qt::Uninitialized);
+    ZSTD_outBuffer output = { block.data(), size_t(blockSize), 0 };
+
+    while(output.pos < output.size)
+    {
+      if(input.pos == input.size && hint == 0)
+      {
+        done = true;
+        break;
+      }
+
+      size_t before = output.pos;
+      hint = ZSTD_decompressStream(stream, &output, &input);
+      if(ZSTD_isError(hint))
+      {
+        ok = false;
+        break;
+      }
+
+      // Input ended inside a frame
+      if(input.pos == input.size && hint != 0 && output.pos == before)
+      {
+        m_errorString = "Truncated zstd file";
+        ok = false;
+        break;
+      }
+    }
+
+    block.resize(int(output.pos));
+    if(ok && !block.isEmpty() && !deliver(block)) ok = false;
+  }
+
+  ZSTD_freeDStream(stream);
+  return ok;
+}
@@ -0,0 +1,89 @@
+#ifndef DECOMPRESSOR_H
+#define DECOMPRESSOR_H
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QFile>
+#include <QFuture>
+#include <QString>
+#include <QThreadPool>
+#include <QVector>
+#include "BlockQueue.h"
+
+// Decompresses a gzip or zstd file on a thread of its own while the caller
+// parses the output.  Blocks of decompressed bytes are handed over through a
+// bounded queue, so only a few blocks are held in memory at once.  Files made
+// of independently compressed pieces, zstd frames recording their size or BGZF
+// gzip blocks, are decompressed a batch of pieces at a time in parallel; other
+// files are decompressed sequentially.
+class Decompressor
+{
+public:
+  enum Format
+  {
+    Uncompressed,
+    Gzip,
+    Zstd
+  };
+
+  // Compression of a file, detected from its magic number
+  static Format format(const QString& path);
+
+  explicit Decompressor(const QString& path);
+
+  // Stops decompression if not all blocks were read
+  ~Decompressor();
+
+  // Starts decompressing.  Returns false if the file cannot be read or is
+  // not compressed; errorString() describes the problem.
+  bool start();
+
+  // Next block of decompressed bytes.  Returns an empty block at the end of
+  // the data or on error; errorString() then describes any error.
+  QByteArray read();
+
+  QString errorString() const { return m_errorString; }
+
+private:
+  Q_DISABLE_COPY(Decompressor)
+
+  // Independently decompressible part of the file
+  struct Piece
+  {
+    qint64 offset;
+    qint64 size;
+    qint64 outputSize;
+    // CRC-32 of the output; only checked for gzip
+    quint32 crc;
+  };
+
+  // Split file into pieces; false if the file has no independent pieces
+  bool findZstdFrames(QVector<Piece> *pieces) const;
+  bool findGzipBlocks(QVector<Piece> *pieces) const;
+
+  // Producers run on the private pool and return false on error
+  bool decompressPieces(const QVector<Piece>& pieces);
+  bool inflateGzip();
+  bool decompressZstd();
+
+  // Queues a block for read(); false if reading was stopped
+  bool deliver(const QByteArray& block);
+
+  QFile m_file;
+  Format m_format;
+  const uchar *m_data;
+  qint64 m_size;
+
+  BlockQueue<QByteArray> m_queue;
+  // Callers may themselves occupy every thread of the global pool while
+  // blocked in read(), so the producer never waits for one of them
+  QThreadPool m_pool;
+  QFuture<void> m_producer;
+  QAtomicInt m_canceled;
+  bool m_started;
+  bool m_finished;
+
+  // Set by the producer before it queues the final empty block
+  QString m_errorString;
+};
+
+#endif // DECOMPRESSOR_H
@@ -0,0 +1,150 @@
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include "DepthMapCache.h"
+
+#include <cstring>
+
+namespace
+{
+  const char magic[8] = { 'D', 'S', 'M', 'D', 'E', 'P', 'T', 'H' };
+  const quint32 version = 1;
+
+  struct Header
+  {
+    char magic[8];
+    quint32 version;
+    quint32 width;
+    quint32 height;
+    quint32 reserved;
+  };
+}
+
+DepthMapCache::DepthMapCache(const QString &directory) :
+  m_directory(directory)
+{
+  QDir().mkpath(m_directory);
+}
+
+QByteArray DepthMapCache::hashFile(const QString &path)
+{
+  QFile file(path);
+  if(!file.open(QIODevice::ReadOnly)) return QByteArray();
+
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  if(!hash.addData(&file)) return QByteArray();
+
+  return hash.result();
+}
+
+QByteArray DepthMapCache::hashFiles(const QStringList &paths)
+{
+  if(paths.count() == 1) return hashFile(paths.first());
+
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  for(const QString& path: paths)
+  {
+    QByteArray fileHash = hashFile(path);
+    if(fileHash.isEmpty()) return QByteArray();
+    hash.addData(fileHash);
+  }
+
+  return hash.result();
+}
+
+QByteArray DepthMapCache::hashScene(const QByteArray &contentHash,
+                                    const QStringList &loadOptions)
+{
+  if(contentHash.isEmpty() || loadOptions.isEmpty()) return contentHash;
+
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  hash.addData(contentHash);
+  for(const QString& option: loadOptions)
+    hash.addData(option.toUtf8() + "\n");
+
+  return hash.result();
+}
+
+QByteArray DepthMapCache::key(const QByteArray &sceneHash,
+                              const SunPosition &sun, int size,
+                              float resolution)
+{
+  // Format version is part of the key so layout changes never collide
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  hash.addData(sceneHash);
+  hash.addData(QByteArray::number(version));
+  hash.addData(QByteArray::number(sun.azimuth(), 'g', 17));
+  hash.addData(QByteArray::number(sun.elevation(), 'g', 17));
+  hash.addData(QByteArray::number(size));
+  hash.addData(QByteArray::number(resolution, 'g', 9));
+
+  return hash.result().toHex();
+}
+
+bool DepthMapCache::load(const QByteArray &key, Array2D<double> *depth) const
+{
+  if(isNull()) return false;
+
+  QFile file(path(key));
+  if(!file.open(QIODevice::ReadOnly)) return false;
+
+  qint64 size = file.size();
+  if(size < qint64(sizeof(Header))) return false;
+
+  uchar *map = file.map(0, size);
+  if(!map) return false;
+
+  Header header;
+  std::memcpy(&header, map, sizeof(Header));
+
+  qint64 expected = qint64(sizeof(Header))
+      + qint64(header.width) * header.height * qint64(sizeof(double));
+
+  bool valid = std::memcmp(header.magic, magic, sizeof(magic)) == 0
+      && header.version == version && size == expected;
+
+  if(valid)
+  {
+    *depth = Array2D<double>(header.width, header.height);
+    std::memcpy(depth->bits(), map + sizeof(Header),
+                size_t(depth->count()) * sizeof(double));
+  }
+
+  file.unmap(map);
+  return valid;
+}
+
+bool DepthMapCache::contains(const QByteArray &key) const
+{
+  return !isNull() && QFileInfo::exists(path(key));
+}
+
+bool DepthMapCache::save(const QByteArray &key,
+                         const Array2D<double> &depth) const
+{
+  if(isNull()) return false;
+
+  Header header;
+  std::memcpy(header.magic, magic, sizeof(magic));
+  header.version = version;
+  header.width = depth.width();
+  header.height = depth.height();
+  header.reserved = 0;
+
+  // Written to a temporary file and renamed on commit
+  QSaveFile file(path(key));
+  if(!file.open(QIODevice::WriteOnly)) return false;
+
+  file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+  file.write(reinterpret_cast<const char*>(depth.constBits()),
+             qint64(depth.count()) * qint64(sizeof(double)));
+
+  return file.commit();
+}
+
+QString DepthMapCache::path(const QByteArray &key) const
+{
+  return QDir(m_directory).filePath(QString::fromLatin1(key) + ".depth");
+}
@@ -0,0 +1,64 @@
+#ifndef DEPTHMAPCACHE_H
+#define DEPTHMAPCACHE_H
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include "Array2D.h"
+#include "SunPosition.h"
+
+// Directory of sun depth maps keyed by scene content and render parameters.
+//
+// Each depth map is stored as a raw file that can be memory-mapped:
+//
+//   offset  size  contents
+//   0       8     magic "DSMDEPTH"
+//   8       4     format version, currently 1
+//   12      4     width
+//   16      4     height
+//   20      4     reserved, 0
+//   24      8*n   width * height doubles in row-major order
+//
+// All values are in host byte order.  Files are written atomically, so
+// concurrent processes sharing a cache directory never read partial maps.
+class DepthMapCache
+{
+public:
+  DepthMapCache() { }
+  explicit DepthMapCache(const QString& directory);
+
+  bool isNull() const { return m_directory.isEmpty(); }
+
+  // Content hash of a scene file; empty if the file cannot be read
+  static QByteArray hashFile(const QString& path);
+
+  // Content hash of a scene made of several files; the same as hashFile()
+  // for a single file
+  static QByteArray hashFiles(const QStringList& paths);
+
+  // Hash of the points loaded from a scene: its content hash combined with
+  // the loading options, as "name=value" strings, that change which points
+  // are kept or where they lie.  The same as contentHash without options.
+  static QByteArray hashScene(const QByteArray& contentHash,
+                              const QStringList& loadOptions);
+
+  // Key identifying a depth map rendered from a scene with parameters
+  static QByteArray key(const QByteArray& sceneHash, const SunPosition& sun,
+                        int size, float resolution);
+
+  // Loads cached depth map for key by memory-mapping its file.  Returns
+  // false if no valid depth map is cached.
+  bool load(const QByteArray& key, Array2D<double>* depth) const;
+
+  // Indicates whether a depth map is cached for key, without loading it
+  bool contains(const QByteArray& key) const;
+
+  // Stores depth map under key.  Returns false on failure.
+  bool save(const QByteArray& key, const Array2D<double>& depth) const;
+
+private:
+  QString path(const QByteArray& key) const;
+
+  QString m_directory;
+};
+
+#endif // DEPTHMAPCACHE_H
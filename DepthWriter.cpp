@@ -0,0 +1,274 @@
+#include <QDebug>
+#include <QFileInfo>
+#include <QImage>
+#include <QSaveFile>
+#include <QSysInfo>
+#include "DepthWriter.h"
+#include "ParallelFor.h"
+
+namespace
+{
+  // Converts depths to floats, rows top to bottom or bottom to top
+  QByteArray floatRows(const Array2D<double>& depth, bool bottomUp)
+  {
+    const int width = depth.width();
+    const int height = depth.height();
+    QByteArray data(int(qint64(width) * height * sizeof(float)), 0);
+    float *values = reinterpret_cast<float*>(data.data());
+    const double *source = depth.constBits();
+
+    parallelFor(height, parallelBlockSize(height), [&](int begin, int end)
+    {
+      for(int y = begin; y < end; ++y)
+      {
+        const double *row = source + qint64(y) * width;
+        float *line = values + qint64(bottomUp ? height - 1 - y : y) * width;
+        for(int x = 0; x < width; ++x) line[x] = float(row[x]);
+      }
+    });
+
+    return data;
+  }
+
+  // Portable float map; a negative scale marks little endian floats
+  bool writePFM(const Array2D<double>& depth, QIODevice *device)
+  {
+    QByteArray header("Pf\n");
+    header += QByteArray::number(depth.width()) + " "
+        + QByteArray::number(depth.height()) + "\n";
+    header += QSysInfo::ByteOrder == QSysInfo::LittleEndian ? "-1.0\n"
+                                                            : "1.0\n";
+    device->write(header);
+
+    // Rows are stored bottom to top
+    QByteArray data = floatRows(depth, true);
+    return device->write(data) == data.size();
+  }
+
+  // Single strip TIFF of host order floats
+  bool writeTIFF(const Array2D<double>& depth, QIODevice *device)
+  {
+    QByteArray data = floatRows(depth, false);
+    const quint32 resolutionOffset = 8 + data.size();
+    const quint32 directoryOffset = resolutionOffset + 8;
+
+    QByteArray header(QSysInfo::ByteOrder == QSysInfo::LittleEndian ? "II"
+                                                                    : "MM",
+                      2);
+    QByteArray directory;
+    QByteArray resolution;
+
+    // Values after the header follow the host byte order as well
+    auto append16 = [](QByteArray *bytes, quint16 value)
+    {
+      bytes->append(reinterpret_cast<const char*>(&value), 2);
+    };
+    auto append32 = [](QByteArray *bytes, quint32 value)
+    {
+      bytes->append(reinterpret_cast<const char*>(&value), 4);
+    };
+
+    append16(&header, 42);
+    append32(&header, directoryOffset);
+    append32(&resolution, 72);
+    append32(&resolution, 1);
+
+    enum { Short = 3, Long = 4, Rational = 5 };
+    auto entry = [&](quint16 tag, quint16 type, quint32 value)
+    {
+      append16(&directory, tag);
+      append16(&directory, type);
+      append32(&directory, 1);
+      // Short values are left-justified in the value field
+      if(type == Short)
+      {
+        append16(&directory, quint16(value));
+        append16(&directory, 0);
+      }
+      else
+      {
+        append32(&directory, value);
+      }
+    };
+
+    // Entries in ascending tag order
+    append16(&directory, 13);
+    entry(256, Long, depth.width());
+    entry(257, Long, depth.height());
+    entry(258, Short, 32);
+    // No compression
+    entry(259, Short, 1);
+    // BlackIsZero
+    entry(262, Short, 1);
+    entry(273, Long, 8);
+    entry(277, Short, 1);
+    entry(278, Long, depth.height());
+    entry(279, Long, data.size());
+    entry(282, Rational, resolutionOffset);
+    entry(283, Rational, resolutionOffset);
+    // No absolute resolution unit
+    entry(296, Short, 1);
+    // IEEE floating point samples
+    entry(339, Short, 3);
+    append32(&directory, 0);
+
+    device->write(header);
+    device->write(data);
+    device->write(resolution);
+    return device->write(directory) == directory.size();
+  }
+
+  // Colormaps of a normalized depth v in [0, 1] to 8-bit channels
+  inline float channel(float v)
+  {
+    return (v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v)) * 255.0f;
+  }
+
+  inline QRgb jet(float v)
+  {
+    return qRgb(int(channel(1.5f - qAbs(4 * v - 3))),
+                int(channel(1.5f - qAbs(4 * v - 2))),
+                int(channel(1.5f - qAbs(4 * v - 1))));
+  }
+
+  inline QRgb hotcold(float v)
+  {
+    return qRgb(int(channel(2 - qAbs(4 * v - 4))),
+                int(channel(2 - qAbs(4 * v - 2))),
+                int(channel(2 - qAbs(4 * v - 0))));
+  }
+}
+
+DepthWriter::DepthWriter() : m_colormap(Gray)
+{
+}
+
+bool DepthWriter::parseColormap(const QString &name, Colormap *colormap)
+{
+  if(name == "gray") *colormap = Gray;
+  else if(name == "jet") *colormap = Jet;
+  else if(name == "hotcold") *colormap = HotCold;
+  else return false;
+
+  return true;
+}
+
+bool DepthWriter::range(const Array2D<double> &depth, double *minimum,
+                        double *maximum)
+{
+  const int width = depth.width();
+  const int height = depth.height();
+  const double *values = depth.constBits();
+
+  // Each block of rows reduces its own range
+  const int blockSize = parallelBlockSize(height);
+  const int blockCount = height > 0 ? (height + blockSize - 1) / blockSize : 0;
+  QVector<double> blockMinimums(blockCount, qInf());
+  QVector<double> blockMaximums(blockCount, -qInf());
+  double *minimums = blockMinimums.data();
+  double *maximums = blockMaximums.data();
+
+  parallelFor(height, blockSize, [&](int begin, int end)
+  {
+    const double *row = values + qint64(begin) * width;
+    const qint64 count = qint64(end - begin) * width;
+    double low = qInf();
+    double high = -qInf();
+
+    // Written without branches so the compiler can vectorize the reduction;
+    // empty pixels are infinite and never lower the minimum
+    for(qint64 i = 0; i < count; ++i)
+    {
+      double value = row[i];
+      double finite = value == qInf() ? -qInf() : value;
+      low = value < low ? value : low;
+      high = finite > high ? finite : high;
+    }
+
+    minimums[begin / blockSize] = low;
+    maximums[begin / blockSize] = high;
+  });
+
+  *minimum = qInf();
+  *maximum = -qInf();
+  for(int b = 0; b < blockCount; ++b)
+  {
+    *minimum = qMin(*minimum, minimums[b]);
+    *maximum = qMax(*maximum, maximums[b]);
+  }
+
+  return *minimum <= *maximum;
+}
+
+bool DepthWriter::save(const Array2D<double> &depth,
+                       const QString &path) const
+{
+  if(depth.isEmpty()) return false;
+
+  QString suffix = QFileInfo(path).suffix().toLower();
+  if(suffix != "pfm" && suffix != "tif" && suffix != "tiff")
+    return saveImage(depth, path);
+
+  // Written to a temporary file and renamed on commit
+  QSaveFile file(path);
+  if(!file.open(QIODevice::WriteOnly)) return false;
+
+  bool written = suffix == "pfm" ? writePFM(depth, &file)
+                                 : writeTIFF(depth, &file);
+
+  return written && file.commit();
+}
+
+bool DepthWriter::saveImage(const Array2D<double> &depth,
+                            const QString &path) const
+{
+  double min, max;
+  if(!range(depth, &min, &max)) min = max = 0.0;
+
+  qDebug() << "Depth min/max:" << min << max;
+
+  const int width = depth.width();
+  const double scale = max > min ? 1.0 / (max - min) : 0.0;
+  const double *values = depth.constBits();
+
+  QImage image(depth.size(), m_colormap == Gray ? QImage::Format_Grayscale16
+                                                : QImage::Format_RGB32);
+
+  // Take pointer before threads start so the image is not detached by them
+  uchar *bits = image.bits();
+  const int bytesPerLine = image.bytesPerLine();
+  const Colormap colormap = m_colormap;
+
+  parallelFor(depth.height(), parallelBlockSize(depth.height()),
+              [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+    {
+      const double *row = values + qint64(y) * width;
+      uchar *line = bits + qint64(y) * bytesPerLine;
+
+      if(colormap == Gray)
+      {
+        // Depths span 1 to 65535 so empty pixels stay distinct at 0
+        quint16 *gray = reinterpret_cast<quint16*>(line);
+        for(int x = 0; x < width; ++x)
+        {
+          double v = (row[x] - min) * scale;
+          gray[x] = row[x] == qInf() ? 0 : quint16(1.5 + v * 65534.0);
+        }
+      }
+      else
+      {
+        QRgb *rgb = reinterpret_cast<QRgb*>(line);
+        for(int x = 0; x < width; ++x)
+        {
+          float v = float((row[x] - min) * scale);
+          if(row[x] == qInf()) rgb[x] = qRgb(0, 0, 0);
+          else rgb[x] = colormap == Jet ? jet(v) : hotcold(v);
+        }
+      }
+    }
+  });
+
+  return image.save(path);
+}
@@ -0,0 +1,44 @@
+#ifndef DEPTHWRITER_H
+#define DEPTHWRITER_H
+#include <QString>
+#include "Array2D.h"
+
+// Writes depth maps whose empty pixels hold infinity.  Float formats keep
+// the depths, with empty pixels left infinite; image formats scale depths
+// between the minimum and maximum depth and leave empty pixels black.
+class DepthWriter
+{
+public:
+  // Colors of image formats
+  enum Colormap
+  {
+    Gray,
+    Jet,
+    HotCold
+  };
+
+  DepthWriter();
+
+  void setColormap(Colormap colormap) { m_colormap = colormap; }
+  Colormap colormap() const { return m_colormap; }
+
+  // Parses "gray", "jet" or "hotcold".  Returns false for other names.
+  static bool parseColormap(const QString& name, Colormap *colormap);
+
+  // Range of non-empty depths, reduced over rows in parallel.  Returns false
+  // if every pixel is empty.
+  static bool range(const Array2D<double>& depth, double *minimum,
+                    double *maximum);
+
+  // Writes depth by suffix: PFM, or 32-bit float TIFF for .tif and .tiff.
+  // Other suffixes are images, 16-bit grayscale for Gray and 8-bit RGB for
+  // the other colormaps.  Returns false on failure.
+  bool save(const Array2D<double>& depth, const QString& path) const;
+
+private:
+  bool saveImage(const Array2D<double>& depth, const QString& path) const;
+
+  Colormap m_colormap;
+};
+
+#endif // DEPTHWRITER_H
@@ -0,0 +1,279 @@
+#include <QFile>
+#include <QFileInfo>
+#include <QtEndian>
+#include "LASData.h"
+#include "ParallelFor.h"
+
+#include <cstring>
+#include <limits>
+
+namespace
+{
+  // Public header block fields used; offsets are those of LAS 1.2 to 1.4
+  struct Header
+  {
+    quint8 versionMinor;
+    quint32 pointOffset;
+    quint8 pointFormat;
+    quint16 recordLength;
+    quint64 count;
+    double scale[3];
+    double offset[3];
+    double minimum[3];
+    double maximum[3];
+  };
+
+  // Smallest record length of each point format
+  const int recordSizes[] = { 20, 28, 26, 34, 57, 63, 30, 36, 38, 59, 67 };
+
+  template<typename T>
+  T field(const uchar *data, int offset)
+  {
+    return qFromLittleEndian<T>(data + offset);
+  }
+
+  double doubleField(const uchar *data, int offset)
+  {
+    quint64 bits = field<quint64>(data, offset);
+    double value;
+    std::memcpy(&value, &bits, sizeof(double));
+    return value;
+  }
+
+  bool readHeader(const uchar *data, qint64 size, Header *header,
+                  QString *errorString)
+  {
+    // Size of the 1.2 header; later versions extend it
+    if(size < 227 || data[0] != 'L' || data[1] != 'A' || data[2] != 'S'
+       || data[3] != 'F')
+    {
+      *errorString = "Not a LAS file";
+      return false;
+    }
+
+    quint8 versionMajor = data[24];
+    header->versionMinor = data[25];
+    if(versionMajor != 1 || header->versionMinor < 2
+       || header->versionMinor > 4)
+    {
+      *errorString = "Unsupported LAS version";
+      return false;
+    }
+
+    quint16 headerSize = field<quint16>(data, 94);
+    header->pointOffset = field<quint32>(data, 96);
+
+    // Bits 6 and 7 of the format mark compressed files
+    quint8 format = data[104];
+    if(format & 0xc0)
+    {
+      *errorString = "Compressed LAS files are not supported";
+      return false;
+    }
+    header->pointFormat = format;
+    if(format > 10)
+    {
+      *errorString = "Unsupported LAS point format";
+      return false;
+    }
+
+    header->recordLength = field<quint16>(data, 105);
+    if(header->recordLength < recordSizes[format])
+    {
+      *errorString = "Invalid LAS point record length";
+      return false;
+    }
+
+    header->count = field<quint32>(data, 107);
+    if(header->versionMinor == 4)
+    {
+      if(headerSize < 375 || size < 375)
+      {
+        *errorString = "Invalid LAS header";
+        return false;
+      }
+
+      // Legacy count is zero for formats 6 to 10 and large files
+      header->count = field<quint64>(data, 247);
+    }
+
+    for(int i = 0; i < 3; ++i)
+    {
+      header->scale[i] = doubleField(data, 131 + 8 * i);
+      header->offset[i] = doubleField(data, 155 + 8 * i);
+      // Maximum and minimum alternate per axis
+      header->maximum[i] = doubleField(data, 179 + 16 * i);
+      header->minimum[i] = doubleField(data, 187 + 16 * i);
+    }
+
+    return true;
+  }
+
+  // Whether a point record passes a return filter
+  bool keepReturn(const uchar *record, bool extended,
+                  LASData::ReturnFilter filter)
+  {
+    if(filter == LASData::AllReturns) return true;
+
+    int returnNumber, returnCount;
+    if(extended)
+    {
+      returnNumber = record[14] & 0x0f;
+      returnCount = record[14] >> 4;
+    }
+    else
+    {
+      returnNumber = record[14] & 0x07;
+      returnCount = (record[14] >> 3) & 0x07;
+    }
+
+    if(filter == LASData::FirstReturns) return returnNumber <= 1;
+    return returnNumber >= returnCount;
+  }
+}
+
+LASData::LASData() : m_returnFilter(AllReturns)
+{
+}
+
+bool LASData::load(const QString &path)
+{
+  m_path = path;
+  m_errorString.clear();
+  m_x.clear();
+  m_y.clear();
+  m_z.clear();
+
+  QFile file(path);
+  if(!file.open(QIODevice::ReadOnly))
+  {
+    m_errorString = "Unable to open file";
+    return false;
+  }
+
+  const qint64 size = file.size();
+  uchar *map = size > 0 ? file.map(0, size) : 0;
+  if(!map)
+  {
+    m_errorString = "Unable to map file";
+    return false;
+  }
+
+  Header header;
+  if(!readHeader(map, size, &header, &m_errorString))
+  {
+    file.unmap(map);
+    return false;
+  }
+
+  const int stride = header.recordLength;
+  if(header.count > quint64(std::numeric_limits<int>::max())
+     || header.pointOffset + qint64(header.count) * stride > size)
+  {
+    m_errorString = "Invalid LAS point count";
+    file.unmap(map);
+    return false;
+  }
+
+  const int count = int(header.count);
+  const uchar *records = map + header.pointOffset;
+  const bool extended = header.pointFormat >= 6;
+  const ReturnFilter filter = m_returnFilter;
+
+  // Blocks are decoded in parallel.  The filter is applied in a first pass
+  // counting kept points per block, so each block knows where to write.
+  const int blockSize = 65536;
+  const int blockCount = (count + blockSize - 1) / blockSize;
+  QVector<int> blockStarts(blockCount + 1, 0);
+  int *starts = blockStarts.data();
+
+  parallelFor(count, blockSize, [=](int begin, int end)
+  {
+    int kept = 0;
+    for(int i = begin; i < end; ++i)
+      kept += keepReturn(records + qint64(i) * stride, extended, filter);
+    starts[begin / blockSize + 1] = kept;
+  });
+
+  for(int b = 0; b < blockCount; ++b) starts[b + 1] += starts[b];
+
+  const int keptCount = starts[blockCount];
+  m_x.resize(keptCount);
+  m_y.resize(keptCount);
+  m_z.resize(keptCount);
+  float *destinations[3] = { m_x.data(), m_y.data(), m_z.data() };
+
+  QVector<float> blockMinimums(3 * blockCount,
+                               std::numeric_limits<float>::max());
+  QVector<float> blockMaximums(3 * blockCount,
+                               -std::numeric_limits<float>::max());
+  float *minimums = blockMinimums.data();
+  float *maximums = blockMaximums.data();
+
+  parallelFor(count, blockSize, [&](int begin, int end)
+  {
+    int block = begin / blockSize;
+    int out = starts[block];
+    float *low = minimums + 3 * block;
+    float *high = maximums + 3 * block;
+
+    for(int i = begin; i < end; ++i)
+    {
+      const uchar *record = records + qint64(i) * stride;
+      if(!keepReturn(record, extended, filter)) continue;
+
+      for(int j = 0; j < 3; ++j)
+      {
+        float value = float(field<qint32>(record, 4 * j) * header.scale[j]
+                            + header.offset[j]);
+        destinations[j][out] = value;
+        low[j] = qMin(low[j], value);
+        high[j] = qMax(high[j], value);
+      }
+      ++out;
+    }
+  });
+
+  file.unmap(map);
+
+  // Combine block results
+  for(int j = 0; j < 3; ++j)
+  {
+    m_minimum[j] = std::numeric_limits<float>::max();
+    m_maximum[j] = -std::numeric_limits<float>::max();
+    for(int block = 0; block < blockCount; ++block)
+    {
+      m_minimum[j] = qMin(m_minimum[j], minimums[3 * block + j]);
+      m_maximum[j] = qMax(m_maximum[j], maximums[3 * block + j]);
+    }
+  }
+
+  return true;
+}
+
+bool LASData::readBounds(const QString &path, QVector3D *minimum,
+                         QVector3D *maximum)
+{
+  QFile file(path);
+  if(!file.open(QIODevice::ReadOnly)) return false;
+
+  QByteArray data = file.read(375);
+  Header header;
+  QString errorString;
+  if(!readHeader(reinterpret_cast<const uchar*>(data.constData()),
+                 data.size(), &header, &errorString))
+  {
+    return false;
+  }
+
+  *minimum = QVector3D(header.minimum[0], header.minimum[1],
+                       header.minimum[2]);
+  *maximum = QVector3D(header.maximum[0], header.maximum[1],
+                       header.maximum[2]);
+  return true;
+}
+
+bool LASData::isLASFile(const QString &path)
+{
+  return QFileInfo(path).suffix().compare("las", Qt::CaseInsensitive) == 0;
+}
@@ -0,0 +1,70 @@
+#ifndef LASDATA_H
+#define LASDATA_H
+
+#include <QString>
+#include <QVector>
+#include <QVector3D>
+
+// Point positions of an uncompressed LAS 1.2 to 1.4 file.  Point records of
+// every format 0 to 10 are decoded in parallel from a memory map, applying
+// the header scale and offset.  Positions are stored as floats, which only
+// resolve large projected coordinates coarsely; UTM northings of 4e6 to 8e6
+// are spaced 0.5 apart.
+class LASData
+{
+public:
+  // Points kept by return number
+  enum ReturnFilter
+  {
+    AllReturns,
+    FirstReturns,
+    LastReturns
+  };
+
+  LASData();
+
+  // Path for loaded data
+  const QString& fileName() const { return m_path; }
+
+  // Get most recent error from loading; empty for no error
+  QString errorString() const { return m_errorString; }
+
+  void setReturnFilter(ReturnFilter filter) { m_returnFilter = filter; }
+  ReturnFilter returnFilter() const { return m_returnFilter; }
+
+  // Loads positions of points passing the return filter.  Returns false on
+  // error; errorString() describes the problem.
+  bool load(const QString& path);
+
+  // Positions of loaded points
+  const QVector<float>& x() const { return m_x; }
+  const QVector<float>& y() const { return m_y; }
+  const QVector<float>& z() const { return m_z; }
+  int vertexCount() const { return m_x.count(); }
+
+  // Bounds of loaded points
+  QVector3D minimum() const { return m_minimum; }
+  QVector3D maximum() const { return m_maximum; }
+
+  // Reads the bounds of all points from the header of a LAS file without
+  // loading them.  Returns false if the header cannot be read.
+  static bool readBounds(const QString& path, QVector3D* minimum,
+                         QVector3D* maximum);
+
+  // Indicates whether path names a LAS file
+  static bool isLASFile(const QString& path);
+
+private:
+  QString m_path;
+  QString m_errorString;
+  ReturnFilter m_returnFilter;
+
+  QVector<float> m_x;
+  QVector<float> m_y;
+  QVector<float> m_z;
+
+  QVector3D m_minimum;
+  QVector3D m_maximum;
+};
+
+#endif // LASDATA_H
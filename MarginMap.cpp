@@ -0,0 +1,191 @@
+#include <QFile>
+#include <QList>
+#include <QSaveFile>
+#include <QSysInfo>
+#include <QtEndian>
+#include "MarginMap.h"
+#include "ParallelFor.h"
+
+#include <cctype>
+#include <cstring>
+
+MarginMap::MarginMap()
+{
+}
+
+MarginMap::MarginMap(const QSize &size) : m_margins(size)
+{
+  m_margins.fill(-qInf());
+}
+
+bool MarginMap::save(const QString &path) const
+{
+  if(isNull()) return false;
+
+  // Portable float map; a negative scale marks little endian floats
+  QByteArray header("Pf\n");
+  header += QByteArray::number(width()) + " " + QByteArray::number(height())
+      + "\n";
+  header += QSysInfo::ByteOrder == QSysInfo::LittleEndian ? "-1.0\n" : "1.0\n";
+
+  // Written to a temporary file and renamed on commit
+  QSaveFile file(path);
+  if(!file.open(QIODevice::WriteOnly)) return false;
+
+  file.write(header);
+
+  // Rows are stored bottom to top
+  const qint64 rowBytes = qint64(width()) * sizeof(float);
+  for(int y = height() - 1; y >= 0; --y)
+  {
+    file.write(reinterpret_cast<const char*>(m_margins.constBits()
+                                             + qint64(y) * width()), rowBytes);
+  }
+
+  return file.commit();
+}
+
+MarginMap MarginMap::load(const QString &path)
+{
+  QFile file(path);
+  if(!file.open(QIODevice::ReadOnly)) return MarginMap();
+
+  QByteArray data = file.readAll();
+
+  // Header of magic, width, height and scale separated by white space
+  QList<QByteArray> fields;
+  int position = 0;
+  while(fields.count() < 4 && position < data.size())
+  {
+    while(position < data.size() && std::isspace(uchar(data.at(position))))
+      ++position;
+    int start = position;
+    while(position < data.size() && !std::isspace(uchar(data.at(position))))
+      ++position;
+    fields.push_back(data.mid(start, position - start));
+  }
+  // A single white space character ends the header
+  ++position;
+
+  bool ok = fields.count() == 4 && fields.at(0) == "Pf";
+  int width = 0, height = 0;
+  double scale = 0.0;
+  if(ok) width = fields.at(1).toInt(&ok);
+  if(ok) height = fields.at(2).toInt(&ok);
+  if(ok) scale = fields.at(3).toDouble(&ok);
+  if(!ok || width <= 0 || height <= 0 || scale == 0.0
+     || data.size() - qint64(position) != 4 * qint64(width) * height)
+  {
+    return MarginMap();
+  }
+
+  // Floats of the other byte order are swapped
+  const bool swap = (scale < 0)
+      != (QSysInfo::ByteOrder == QSysInfo::LittleEndian);
+  const uchar *values = reinterpret_cast<const uchar*>(data.constData())
+      + position;
+
+  MarginMap map(QSize(width, height));
+  float *margins = map.m_margins.bits();
+  parallelFor(height, parallelBlockSize(height), [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+    {
+      // Rows are stored bottom to top
+      const uchar *row = values + 4 * qint64(height - 1 - y) * width;
+      float *line = margins + qint64(y) * width;
+      for(int x = 0; x < width; ++x)
+      {
+        quint32 bits;
+        std::memcpy(&bits, row + 4 * x, 4);
+        if(swap) bits = qbswap(bits);
+        std::memcpy(line + x, &bits, 4);
+      }
+    }
+  });
+
+  return map;
+}
+
+BitMask MarginMap::threshold(float bias) const
+{
+  BitMask mask(size());
+  const int w = width();
+  const float *margins = m_margins.constBits();
+
+  parallelFor(height(), parallelBlockSize(height()), [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+    {
+      const float *row = margins + qint64(y) * w;
+      // Rows are whole words, so threads never share one
+      quint64 *line = mask.scanLine(y);
+
+      for(int word = 0; word < mask.wordsPerLine(); ++word)
+      {
+        const int first = word * 64;
+        const int count = qMin(64, w - first);
+
+        // Comparisons without branches; NaN is never in shadow
+        quint64 bits = 0;
+        for(int i = 0; i < count; ++i)
+          bits |= quint64(row[first + i] > bias) << i;
+        line[word] = bits;
+      }
+    }
+  });
+
+  return mask;
+}
+
+QVector<double> MarginMap::shadowFractions(const QVector<float> &biases) const
+{
+  const int w = width();
+  const int h = height();
+  const int biasCount = biases.count();
+  const float *margins = m_margins.constBits();
+  const float *biasValues = biases.constData();
+
+  // Each block of rows counts pixels in shadow for every bias, then pixels
+  // with a position, while its rows stay in cache
+  const int blockSize = parallelBlockSize(h);
+  const int blockCount = h > 0 ? (h + blockSize - 1) / blockSize : 0;
+  QVector<qint64> blockCounts(blockCount * (biasCount + 1), 0);
+  qint64 *counts = blockCounts.data();
+
+  parallelFor(h, blockSize, [&](int begin, int end)
+  {
+    const float *values = margins + qint64(begin) * w;
+    const qint64 count = qint64(end - begin) * w;
+    qint64 *blockCount = counts + (begin / blockSize) * (biasCount + 1);
+
+    // Written without branches so the compiler can vectorize the counts
+    for(int b = 0; b < biasCount; ++b)
+    {
+      const float bias = biasValues[b];
+      qint64 shadowed = 0;
+      for(qint64 i = 0; i < count; ++i) shadowed += values[i] > bias;
+      blockCount[b] = shadowed;
+    }
+
+    // NaN marks pixels without a position
+    qint64 valid = 0;
+    for(qint64 i = 0; i < count; ++i) valid += values[i] == values[i];
+    blockCount[biasCount] = valid;
+  });
+
+  qint64 valid = 0;
+  for(int block = 0; block < blockCount; ++block)
+    valid += counts[block * (biasCount + 1) + biasCount];
+
+  QVector<double> fractions(biasCount, 0.0);
+  for(int b = 0; b < biasCount && valid > 0; ++b)
+  {
+    qint64 shadowed = 0;
+    for(int block = 0; block < blockCount; ++block)
+      shadowed += counts[block * (biasCount + 1) + b];
+    fractions[b] = double(shadowed) / valid;
+  }
+
+  return fractions;
+}
@@ -0,0 +1,48 @@
+#ifndef MARGINMAP_H
+#define MARGINMAP_H
+#include <QSize>
+#include <QString>
+#include <QVector>
+#include "Array2D.h"
+#include "BitMask.h"
+
+// Shadow margins of a camera pass for one sun: for each pixel, the sun
+// depth of its visible position less the depth in the sun depth map.  A
+// pixel is in shadow for bias b when its margin exceeds b, so masks for any
+// bias follow from the margins alone.  Pixels outside the sun depth map are
+// -infinity, never in shadow; pixels without a position are NaN and are not
+// counted at all.  Saved as a grayscale PFM file.
+class MarginMap
+{
+public:
+  MarginMap();
+  explicit MarginMap(const QSize& size);
+
+  bool isNull() const { return m_margins.isEmpty(); }
+
+  int width()  const { return m_margins.width();  }
+  int height() const { return m_margins.height(); }
+  QSize size() const { return m_margins.size(); }
+
+  float& operator()(int x, int y) { return m_margins(x, y); }
+  float operator()(int x, int y) const { return m_margins(x, y); }
+
+  // Writes a PFM file in host byte order.  Returns false on failure.
+  bool save(const QString& path) const;
+
+  // Reads a grayscale PFM file of either byte order; returns a null map on
+  // failure
+  static MarginMap load(const QString& path);
+
+  // Mask of the pixels in shadow for bias; rows are thresholded in parallel
+  BitMask threshold(float bias) const;
+
+  // Fraction of pixels with a position that are in shadow for each bias,
+  // counted in one parallel pass over the margins
+  QVector<double> shadowFractions(const QVector<float>& biases) const;
+
+private:
+  Array2D<float> m_margins;
+};
+
+#endif // MARGINMAP_H
@@ -0,0 +1,182 @@
+#include "OccupancyGrid.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+OccupancyGrid::OccupancyGrid() : m_cellSize(0)
+{
+  for(int i = 0; i < 3; ++i)
+  {
+    m_dimensions[i] = 0;
+    m_brickDimensions[i] = 0;
+  }
+}
+
+OccupancyGrid::OccupancyGrid(const QVector3D &minimum,
+                             const QVector3D &maximum, float cellSize) :
+  m_cellSize(cellSize)
+{
+  QVector3D extent;
+  for(int i = 0; i < 3; ++i)
+  {
+    // Always at least one cell so points on the maximum are inside
+    m_dimensions[i] = int((maximum[i] - minimum[i]) / cellSize) + 1;
+    m_brickDimensions[i] = (m_dimensions[i] + BrickDimension - 1)
+        / BrickDimension;
+    extent[i] = m_dimensions[i] * cellSize;
+  }
+
+  m_bounds = Box(minimum, minimum + extent);
+
+  m_brickTable.fill(-1, m_brickDimensions[0] * m_brickDimensions[1]
+                        * m_brickDimensions[2]);
+}
+
+void OccupancyGrid::insert(const QVector3D &point)
+{
+  int cell[3];
+  for(int i = 0; i < 3; ++i)
+  {
+    cell[i] = int(std::floor((point[i] - m_bounds.minimum()[i]) / m_cellSize));
+    if(cell[i] < 0 || cell[i] >= m_dimensions[i]) return;
+  }
+
+  int &index = m_brickTable[brickIndex(cell[0] / BrickDimension,
+                                       cell[1] / BrickDimension,
+                                       cell[2] / BrickDimension)];
+  // Allocate brick on first use
+  if(index < 0)
+  {
+    Brick brick;
+    std::memset(brick.slices, 0, sizeof(brick.slices));
+    index = m_bricks.count();
+    m_bricks.push_back(brick);
+  }
+
+  Brick &brick = m_bricks[index];
+  brick.slices[cell[2] % BrickDimension] |=
+      Q_UINT64_C(1) << (cell[0] % BrickDimension
+                        + BrickDimension * (cell[1] % BrickDimension));
+}
+
+bool OccupancyGrid::isOccupied(const QVector3D &point) const
+{
+  int cell[3];
+  for(int i = 0; i < 3; ++i)
+  {
+    cell[i] = int(std::floor((point[i] - m_bounds.minimum()[i]) / m_cellSize));
+    if(cell[i] < 0 || cell[i] >= m_dimensions[i]) return false;
+  }
+
+  int index = m_brickTable.at(brickIndex(cell[0] / BrickDimension,
+                                         cell[1] / BrickDimension,
+                                         cell[2] / BrickDimension));
+  if(index < 0) return false;
+
+  return cellOccupied(m_bricks.at(index), cell[0] % BrickDimension,
+                      cell[1] % BrickDimension, cell[2] % BrickDimension);
+}
+
+bool OccupancyGrid::intersect(const Ray &ray, double tmin, double tmax,
+                              double *t, QVector3D *center) const
+{
+  if(m_bricks.isEmpty()) return false;
+
+  // Clip ray to grid bounds
+  double t0, t1;
+  if(!m_bounds.intersects(ray, &t0, &t1)) return false;
+  t0 = qMax(t0, tmin);
+  t1 = qMin(t1, tmax);
+  if(t0 > t1) return false;
+
+  const double brickSize = double(m_cellSize) * BrickDimension;
+  const int cellDimensions[3] = { BrickDimension, BrickDimension,
+                                  BrickDimension };
+
+  // Coarse traversal over bricks, skipping empty ones
+  return march(ray, m_bounds.minimum(), brickSize, m_brickDimensions, t0, t1,
+               [&](const int brickCell[3], double brickEnter, double brickExit)
+  {
+    int index = m_brickTable.at(brickIndex(brickCell[0], brickCell[1],
+                                           brickCell[2]));
+    if(index < 0) return false;
+
+    const Brick &brick = m_bricks.at(index);
+    QVector3D brickOrigin = m_bounds.minimum()
+        + QVector3D(brickCell[0], brickCell[1], brickCell[2]) * brickSize;
+
+    // Fine traversal over the cells of an occupied brick
+    return march(ray, brickOrigin, m_cellSize, cellDimensions, brickEnter,
+                 brickExit, [&](const int cell[3], double enter, double)
+    {
+      if(!cellOccupied(brick, cell[0], cell[1], cell[2])) return false;
+
+      if(t) *t = enter;
+      if(center)
+      {
+        *center = brickOrigin + (QVector3D(cell[0], cell[1], cell[2])
+                                 + QVector3D(0.5f, 0.5f, 0.5f)) * m_cellSize;
+      }
+      return true;
+    });
+  });
+}
+
+template<typename F>
+bool OccupancyGrid::march(const Ray &ray, const QVector3D &origin,
+                          double size, const int dimensions[3], double t0,
+                          double t1, F visit)
+{
+  const double infinity = std::numeric_limits<double>::infinity();
+
+  int cell[3];
+  int step[3];
+  double tNext[3];
+  double tDelta[3];
+
+  for(int i = 0; i < 3; ++i)
+  {
+    // Positions are computed in double relative to the grid origin to keep
+    // precision for large world coordinates
+    double o = double(ray.origin()[i]) - origin[i];
+    double d = ray.direction()[i];
+
+    cell[i] = qBound(0, int(std::floor((o + d * t0) / size)),
+                     dimensions[i] - 1);
+
+    if(d > 0)
+    {
+      step[i] = 1;
+      tNext[i] = ((cell[i] + 1) * size - o) / d;
+      tDelta[i] = size / d;
+    } else if(d < 0) {
+      step[i] = -1;
+      tNext[i] = (cell[i] * size - o) / d;
+      tDelta[i] = -size / d;
+    } else {
+      step[i] = 0;
+      tNext[i] = infinity;
+      tDelta[i] = infinity;
+    }
+  }
+
+  double t = t0;
+  for(;;)
+  {
+    // Axis of nearest cell boundary
+    int axis = 0;
+    if(tNext[1] < tNext[axis]) axis = 1;
+    if(tNext[2] < tNext[axis]) axis = 2;
+
+    if(visit(cell, t, qMin(tNext[axis], t1))) return true;
+
+    if(tNext[axis] >= t1) return false;
+
+    t = tNext[axis];
+    cell[axis] += step[axis];
+    if(cell[axis] < 0 || cell[axis] >= dimensions[axis]) return false;
+
+    tNext[axis] += tDelta[axis];
+  }
+}
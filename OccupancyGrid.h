@@ -0,0 +1,76 @@
+#ifndef OCCUPANCYGRID_H
+#define OCCUPANCYGRID_H
+#include <QVector>
+#include <QVector3D>
+#include "Box.h"
+#include "Ray.h"
+
+// Sparse two-level voxel occupancy.  The grid is divided into coarse bricks of
+// 8x8x8 cells; only bricks containing at least one occupied cell are stored,
+// each as a 512 bit mask.  Rays are traversed with a 3D DDA over bricks,
+// descending into the cells of occupied bricks only.
+class OccupancyGrid
+{
+public:
+  OccupancyGrid();
+  OccupancyGrid(const QVector3D& minimum, const QVector3D& maximum,
+                float cellSize);
+
+  // Marks the cell containing point as occupied; points outside the grid
+  // bounds are ignored.  Not thread-safe.
+  void insert(const QVector3D& point);
+
+  bool isOccupied(const QVector3D& point) const;
+
+  Box bounds() const { return m_bounds; }
+  float cellSize() const { return m_cellSize; }
+
+  // Number of allocated (non-empty) bricks
+  int brickCount() const { return m_bricks.count(); }
+
+  // Finds the first occupied cell along ray with distance in [tmin, tmax].
+  // Returns false if there is none.  On a hit, *t is set to the distance at
+  // which the ray enters the occupied cell and *center to the cell center.
+  bool intersect(const Ray& ray, double tmin, double tmax, double *t = 0,
+                 QVector3D *center = 0) const;
+
+private:
+  // Cells along each axis of a brick
+  static const int BrickDimension = 8;
+
+  // One bit per cell; word z holds the 8x8 xy slice at that z
+  struct Brick
+  {
+    quint64 slices[BrickDimension];
+  };
+
+  int brickIndex(int bx, int by, int bz) const
+  {
+    return bx + m_brickDimensions[0] * (by + m_brickDimensions[1] * bz);
+  }
+
+  bool cellOccupied(const Brick& brick, int cx, int cy, int cz) const
+  {
+    return brick.slices[cz] & (Q_UINT64_C(1) << (cx + BrickDimension * cy));
+  }
+
+  // Walks the cells of a regular grid crossed by ray between t0 and t1 in
+  // front to back order, calling visit(cell, tEnter, tExit) for each.  Stops
+  // and returns true as soon as visit returns true.
+  template<typename F>
+  static bool march(const Ray& ray, const QVector3D& origin, double size,
+                    const int dimensions[3], double t0, double t1, F visit);
+
+  Box m_bounds;
+  float m_cellSize;
+
+  // Number of cells and bricks along each axis
+  int m_dimensions[3];
+  int m_brickDimensions[3];
+
+  // Index into m_bricks for each coarse brick; -1 for an empty brick
+  QVector<int> m_brickTable;
+  QVector<Brick> m_bricks;
+};
+
+#endif // OCCUPANCYGRID_H
@@ -20,6 +20,12 @@ public:
     m_parser.addOption(option);
   }
 
+  void addOption(const QString& longName, const QString description)
+  {
+    QCommandLineOption option(QStringList() << longName, description);
+    m_parser.addOption(option);
+  }
+
   void addOption(QChar shortName, const QString& longName,
                  const QString description, const QString& valueName)
   {
@@ -148,6 +154,12 @@ public:
     return *value;
   }
 
+  // All values of an option given more than once
+  QStringList values(const QString& option) const
+  {
+    return m_parser.values(option);
+  }
+
   void showHelp() { m_parser.showHelp(); }
 
   bool parse(const QStringList& args);
@@ -0,0 +1,56 @@
+#include <QDebug>
+#include <QtConcurrent>
+#include "OutputQueue.h"
+
+OutputQueue::OutputQueue(int capacity) :
+  m_free(capacity), m_failures(0)
+{
+  // A thread per output in flight; encoders split large outputs across the
+  // global pool themselves
+  m_pool.setMaxThreadCount(capacity);
+}
+
+OutputQueue::~OutputQueue()
+{
+  m_pool.waitForDone();
+}
+
+void OutputQueue::write(const QString &path, const std::function<bool()> &f)
+{
+  // Backpressure: wait for a slot when every output is still being written
+  m_free.acquire();
+
+  QtConcurrent::run(&m_pool, [this, path, f]()
+  {
+    if(!f())
+    {
+      qWarning() << "Failed saving" << path;
+      m_failures.ref();
+    }
+
+    m_free.release();
+  });
+}
+
+void OutputQueue::save(const BitMask &mask, const QString &path,
+                       bool packBits)
+{
+  write(path, [mask, path, packBits]() { return mask.save(path, packBits); });
+}
+
+void OutputQueue::save(const Array2D<double> &depth, const QString &path,
+                       const DepthWriter &writer)
+{
+  write(path, [depth, path, writer]() { return writer.save(depth, path); });
+}
+
+void OutputQueue::save(const QImage &image, const QString &path)
+{
+  write(path, [image, path]() { return image.save(path); });
+}
+
+int OutputQueue::waitForFinished()
+{
+  m_pool.waitForDone();
+  return m_failures.fetchAndStoreOrdered(0);
+}
@@ -0,0 +1,49 @@
+#ifndef OUTPUTQUEUE_H
+#define OUTPUTQUEUE_H
+#include <QAtomicInt>
+#include <QImage>
+#include <QSemaphore>
+#include <QString>
+#include <QThreadPool>
+#include "Array2D.h"
+#include "BitMask.h"
+#include "DepthWriter.h"
+
+#include <functional>
+
+// Writes finished outputs on background threads, so rendering threads hand
+// them over instead of waiting on encoding and disk writes.  At most
+// capacity outputs are in flight; queueing another blocks until one has
+// been written, so memory stays bounded when encoding falls behind.
+// Failures are reported with qWarning() as they happen.
+class OutputQueue
+{
+public:
+  explicit OutputQueue(int capacity = 4);
+
+  // Waits for every queued output
+  ~OutputQueue();
+
+  // Queues f, which writes the output at path and returns false on failure
+  void write(const QString& path, const std::function<bool()>& f);
+
+  // Queue copies of finished outputs; the copies share data with the
+  // originals, which must not be modified afterwards
+  void save(const BitMask& mask, const QString& path, bool packBits = false);
+  void save(const Array2D<double>& depth, const QString& path,
+            const DepthWriter& writer);
+  void save(const QImage& image, const QString& path);
+
+  // Waits for every queued output.  Returns the number of outputs that
+  // failed since the last call.
+  int waitForFinished();
+
+private:
+  Q_DISABLE_COPY(OutputQueue)
+
+  QThreadPool m_pool;
+  QSemaphore m_free;
+  QAtomicInt m_failures;
+};
+
+#endif // OUTPUTQUEUE_H
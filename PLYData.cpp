@@ -1,12 +1,191 @@
 #include <QDebug>
 #include <QCoreApplication>
+#include <QAtomicInt>
+#include <QBuffer>
+#include <QFile>
+#include <QSysInfo>
+#include "Decompressor.h"
+#include "ParallelFor.h"
 #include "PLYData.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <limits>
 
+// Reads a value of type T from unaligned memory, reversing the bytes when
+// the file byte order differs from the host
+template<typename T>
+static inline T readValue(const uchar *source, bool swap)
+{
+  uchar bytes[sizeof(T)];
+  if(swap)
+  {
+    for(size_t i = 0; i < sizeof(T); ++i)
+      bytes[i] = source[sizeof(T) - 1 - i];
+  }
+  else
+  {
+    std::memcpy(bytes, source, sizeof(T));
+  }
+
+  T value;
+  std::memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+// Copies one property of count records with the given stride into a
+// contiguous float array
+template<typename T>
+static void deinterleave(const uchar *source, int stride, int count,
+                         bool swap, float *destination)
+{
+  // Separate loops keep the common native byte order loop branch free
+  if(swap)
+  {
+    for(int i = 0; i < count; ++i)
+      destination[i] = readValue<T>(source + qint64(i) * stride, true);
+  }
+  else
+  {
+    for(int i = 0; i < count; ++i)
+      destination[i] = readValue<T>(source + qint64(i) * stride, false);
+  }
+}
+
+static void deinterleave(e_ply_type type, const uchar *source, int stride,
+                         int count, bool swap, float *destination)
+{
+  switch(type)
+  {
+  case PLY_INT8: case PLY_CHAR:
+    deinterleave<qint8>(source, stride, count, swap, destination); break;
+  case PLY_UINT8: case PLY_UCHAR:
+    deinterleave<quint8>(source, stride, count, swap, destination); break;
+  case PLY_INT16: case PLY_SHORT:
+    deinterleave<qint16>(source, stride, count, swap, destination); break;
+  case PLY_UINT16: case PLY_USHORT:
+    deinterleave<quint16>(source, stride, count, swap, destination); break;
+  case PLY_INT32: case PLY_INT:
+    deinterleave<qint32>(source, stride, count, swap, destination); break;
+  case PLY_UIN32: case PLY_UINT:
+    deinterleave<quint32>(source, stride, count, swap, destination); break;
+  case PLY_FLOAT32: case PLY_FLOAT:
+    deinterleave<float>(source, stride, count, swap, destination); break;
+  case PLY_FLOAT64: case PLY_DOUBLE:
+    deinterleave<double>(source, stride, count, swap, destination); break;
+  default:
+    break;
+  }
+}
+
+// Parses a decimal number starting at p, skipping leading blanks but not
+// newlines, and advances p past it.  Independent of the C locale, unlike
+// strtod.  Returns false if no number is found.
+static inline bool parseNumber(const char *&p, const char *end, double *value)
+{
+  // Exactly representable powers of ten
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+  // Significant digits beyond what fits in 64 bits only shift the exponent
+  quint64 mantissa = 0;
+  int exponent = 0;
+  int digits = 0;
+  const char *start = p;
+
+  for(; p < end && *p >= '0' && *p <= '9'; ++p)
+  {
+    if(digits < 19)
+    {
+      mantissa = mantissa * 10 + (*p - '0');
+      if(mantissa) ++digits;
+    }
+    else
+    {
+      ++exponent;
+    }
+  }
+
+  if(p < end && *p == '.')
+  {
+    for(++p; p < end && *p >= '0' && *p <= '9'; ++p)
+    {
+      if(digits < 19)
+      {
+        mantissa = mantissa * 10 + (*p - '0');
+        if(mantissa) ++digits;
+        --exponent;
+      }
+    }
+  }
+
+  // Require at least one digit
+  if(p == start || (p == start + 1 && *start == '.')) return false;
+
+  if(p < end && (*p == 'e' || *p == 'E'))
+  {
+    ++p;
+    bool negativeExponent = false;
+    if(p < end && (*p == '-' || *p == '+')) negativeExponent = (*p++ == '-');
+    if(p >= end || *p < '0' || *p > '9') return false;
+
+    int e = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; ++p)
+      if(e < 10000) e = e * 10 + (*p - '0');
+    exponent += negativeExponent ? -e : e;
+  }
+
+  // Number must end at whitespace
+  if(p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+    return false;
+
+  double result = double(mantissa);
+  if(exponent < 0 && exponent >= -22) result /= powers[-exponent];
+  else if(exponent > 0 && exponent <= 22) result *= powers[exponent];
+  else if(exponent != 0) result *= std::pow(10.0, exponent);
+
+  *value = negative ? -result : result;
+  return true;
+}
+
+// Skips a whitespace separated token without parsing it.  Returns false if
+// the line ends first.
+static inline bool skipToken(const char *&p, const char *end)
+{
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+  if(p == end || *p == '\n') return false;
+
+  while(p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') ++p;
+  return true;
+}
+
+// Extends minimum and maximum by values.  Written without branches so the
+// compiler can vectorize the reduction.
+static void reduceMinMax(const float *values, int count, float *minimum,
+                         float *maximum)
+{
+  float low = *minimum;
+  float high = *maximum;
+  for(int i = 0; i < count; ++i)
+  {
+    low = values[i] < low ? values[i] : low;
+    high = values[i] > high ? values[i] : high;
+  }
+  *minimum = low;
+  *maximum = high;
+}
+
 PLYData::PLYData(QObject *parent) :
-  QObject(parent), m_loadCanceled(false), m_valuesLoaded(0),
-  m_progressInterval(1)
+  QObject(parent), m_rangeFirst(0), m_rangeCount(-1), m_loadCanceled(false),
+  m_valuesLoaded(0), m_progressInterval(1)
 {
 }
 
@@ -20,9 +199,35 @@ bool PLYData::load(const QString &path)
 {
   bool result = false;
 
+  // Discard previously loaded data
+  clear();
+
   // Save path for file being loaded
   m_path = path;
 
+  // Compressed files are parsed while they are decompressed
+  if(Decompressor::format(path) != Decompressor::Uncompressed)
+    return loadCompressed();
+
+  // Use bulk decoding when the file layout allows it
+  PLYHeader header;
+  if(header.read(path))
+  {
+    if(canLoadBinary(header)) return loadBinary(header);
+
+    if(m_rangeCount >= 0)
+    {
+      m_errorString = "Vertex ranges require fixed-size binary vertex records";
+      emit loadFinished();
+      return false;
+    }
+
+    if(canLoadAscii(header) && loadAscii(header)) return true;
+
+    // Discard partial results of the fast path
+    clear();
+  }
+
   // Open ply file
   p_ply ply = ply_open(qPrintable(path), errorCallback, 0, this);
 
@@ -84,6 +289,9 @@ bool PLYData::load(const QString &path)
         const char *name = NULL;
         ply_get_property_info(property, &name, NULL, NULL, NULL);
 
+        // Properties without a callback are read and discarded by rply
+        if(!isRequested(name)) continue;
+
         // Set up callback and get count
         int count = ply_set_read_cb(ply, "vertex", name, vertexCallback, this,
                                     propertyIndex);
@@ -218,6 +426,508 @@ void PLYData::cancelLoad()
   m_loadCanceled = true;
 }
 
+void PLYData::clear()
+{
+  m_errorString.clear();
+  m_comments.clear();
+  m_vertexProperties.clear();
+  m_vertexData.clear();
+  m_minimums.clear();
+  m_maximums.clear();
+}
+
+bool PLYData::canLoadBinary(const PLYHeader &header)
+{
+  if(header.storageMode() == PLY_ASCII) return false;
+
+  // Vertex records must have a fixed size and a known position
+  int element = header.elementIndex("vertex");
+  return element >= 0 && header.recordSize(element) > 0
+      && header.elementOffset(element) >= 0;
+}
+
+bool PLYData::vertexRange(const PLYHeader &header, qint64 *first,
+                          int *count)
+{
+  const PLYHeader::Element &vertex =
+      header.elements().at(header.elementIndex("vertex"));
+
+  // Records of the requested range; all by default
+  *first = qBound(qint64(0), m_rangeFirst, vertex.count);
+  qint64 available = vertex.count - *first;
+  qint64 requested = m_rangeCount < 0 ? available
+                                      : qMin(qint64(m_rangeCount), available);
+  if(requested > std::numeric_limits<int>::max())
+  {
+    m_errorString = "Too many vertices; load a vertex range";
+    return false;
+  }
+
+  *count = int(requested);
+  return true;
+}
+
+void PLYData::allocateBinary(const PLYHeader &header, int count,
+                             BinaryLayout *layout)
+{
+  int element = header.elementIndex("vertex");
+  const PLYHeader::Element &vertex = header.elements().at(element);
+
+  layout->stride = header.recordSize(element);
+  layout->swap = (header.storageMode() == PLY_LITTLE_ENDIAN)
+      != (QSysInfo::ByteOrder == QSysInfo::LittleEndian);
+
+  // Allocate arrays of requested properties and pointers for filling them
+  // from threads.  Other properties are skipped by the record stride.
+  for(int p = 0; p < vertex.properties.count(); ++p)
+  {
+    const PLYHeader::Property &property = vertex.properties.at(p);
+    if(!isRequested(property.name)) continue;
+
+    m_vertexProperties.push_back(property.name);
+    m_vertexData.push_back(QVector<float>(count));
+    layout->destinations.push_back(m_vertexData.last().data());
+    layout->offsets.push_back(header.propertyOffset(element, p));
+    layout->types.push_back(property.type);
+    m_minimums.push_back(std::numeric_limits<float>::max());
+    m_maximums.push_back(-std::numeric_limits<float>::max());
+  }
+}
+
+void PLYData::decodeBinary(const BinaryLayout &layout, const uchar *records,
+                           int first, int count)
+{
+  const int propertyCount = layout.destinations.count();
+  const int stride = layout.stride;
+
+  // Blocks of records are decoded in parallel, each reducing its own
+  // minimum and maximum per property
+  const int blockSize = 65536;
+  const int blockCount = (count + blockSize - 1) / blockSize;
+  QVector<float> blockMinimums(blockCount * propertyCount,
+                               std::numeric_limits<float>::max());
+  QVector<float> blockMaximums(blockCount * propertyCount,
+                               -std::numeric_limits<float>::max());
+  float *minimums = blockMinimums.data();
+  float *maximums = blockMaximums.data();
+
+  parallelFor(count, blockSize, [&](int begin, int end)
+  {
+    int block = begin / blockSize;
+    for(int p = 0; p < propertyCount; ++p)
+    {
+      float *values = layout.destinations.at(p) + first + begin;
+      deinterleave(layout.types.at(p),
+                   records + qint64(begin) * stride + layout.offsets.at(p),
+                   stride, end - begin, layout.swap, values);
+      reduceMinMax(values, end - begin, &minimums[block * propertyCount + p],
+                   &maximums[block * propertyCount + p]);
+    }
+  });
+
+  // Combine block results
+  for(int p = 0; p < propertyCount; ++p)
+  {
+    for(int block = 0; block < blockCount; ++block)
+    {
+      m_minimums[p] = qMin(m_minimums[p], minimums[block * propertyCount + p]);
+      m_maximums[p] = qMax(m_maximums[p], maximums[block * propertyCount + p]);
+    }
+  }
+}
+
+bool PLYData::loadBinary(const PLYHeader &header)
+{
+  qint64 first;
+  int count;
+  if(!vertexRange(header, &first, &count))
+  {
+    emit loadFinished();
+    return false;
+  }
+
+  int element = header.elementIndex("vertex");
+  const int stride = header.recordSize(element);
+  const qint64 offset = header.elementOffset(element) + first * stride;
+  const qint64 size = qint64(count) * stride;
+
+  // Map vertex records
+  QFile file(m_path);
+  uchar *records = 0;
+  if(file.open(QIODevice::ReadOnly) && offset + size <= file.size()
+     && size > 0)
+  {
+    records = file.map(offset, size);
+  }
+
+  if(!records && size > 0)
+  {
+    m_errorString = "Unable to read vertex data";
+    emit loadFinished();
+    return false;
+  }
+
+  m_comments = header.comments();
+
+  BinaryLayout layout;
+  allocateBinary(header, count, &layout);
+  const int propertyCount = layout.destinations.count();
+
+  m_loadCanceled = false;
+  emit loadStarted(count * propertyCount);
+
+  decodeBinary(layout, records, 0, count);
+
+  if(records) file.unmap(records);
+
+  emit loadProgress(count * propertyCount);
+  emit loadFinished();
+
+  return true;
+}
+
+bool PLYData::loadCompressed()
+{
+  Decompressor decompressor(m_path);
+  if(!decompressor.start())
+  {
+    m_errorString = decompressor.errorString();
+    emit loadFinished();
+    return false;
+  }
+
+  // Decompressed bytes not yet parsed; gathered until they hold the header
+  QByteArray data;
+  for(;;)
+  {
+    int end = data.indexOf("end_header");
+    if(end >= 0 && data.indexOf('\n', end) >= 0) break;
+
+    QByteArray block = decompressor.read();
+    if(block.isEmpty())
+    {
+      m_errorString = decompressor.errorString().isEmpty()
+          ? QString("Unexpected end of header") : decompressor.errorString();
+      emit loadFinished();
+      return false;
+    }
+    data += block;
+  }
+
+  PLYHeader header;
+  {
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    if(!header.read(&buffer))
+    {
+      m_errorString = header.errorString();
+      emit loadFinished();
+      return false;
+    }
+  }
+  data.remove(0, int(header.dataOffset()));
+
+  bool result = false;
+  if(canLoadBinary(header))
+  {
+    result = loadCompressedBinary(header, &decompressor, data);
+  }
+  else if(m_rangeCount >= 0)
+  {
+    m_errorString = "Vertex ranges require fixed-size binary vertex records";
+  }
+  else if(canLoadAscii(header))
+  {
+    // Lines are split among threads, so the whole body is gathered first
+    for(QByteArray block = decompressor.read(); !block.isEmpty();
+        block = decompressor.read())
+    {
+      if(data.size() > std::numeric_limits<int>::max() - block.size())
+      {
+        m_errorString = "Compressed ASCII data is too large";
+        break;
+      }
+      data += block;
+    }
+
+    if(m_errorString.isEmpty()) m_errorString = decompressor.errorString();
+    if(m_errorString.isEmpty())
+    {
+      result = parseAscii(header, data.constData(), data.size());
+      if(!result)
+      {
+        clear();
+        m_errorString = "Unable to parse ASCII vertex data";
+      }
+    }
+  }
+  else
+  {
+    m_errorString = "Compressed files require scalar vertex properties";
+  }
+
+  if(!result) emit loadFinished();
+  return result;
+}
+
+bool PLYData::loadCompressedBinary(const PLYHeader &header,
+                                   Decompressor *decompressor,
+                                   QByteArray data)
+{
+  qint64 first;
+  int count;
+  if(!vertexRange(header, &first, &count)) return false;
+
+  int element = header.elementIndex("vertex");
+  const int stride = header.recordSize(element);
+
+  // Bytes before the first requested record
+  qint64 skip = header.elementOffset(element) - header.dataOffset()
+      + first * stride;
+
+  m_comments = header.comments();
+
+  BinaryLayout layout;
+  allocateBinary(header, count, &layout);
+  const int propertyCount = layout.destinations.count();
+
+  m_loadCanceled = false;
+  emit loadStarted(count * propertyCount);
+
+  // Whole records of each block are decoded as it arrives; a partial record
+  // is kept for the next block
+  int decoded = 0;
+  for(;;)
+  {
+    if(skip > 0)
+    {
+      int skipped = int(qMin(skip, qint64(data.size())));
+      data.remove(0, skipped);
+      skip -= skipped;
+    }
+
+    int records = skip > 0 ? 0 : qMin(data.size() / stride, count - decoded);
+    if(records > 0)
+    {
+      decodeBinary(layout,
+                   reinterpret_cast<const uchar*>(data.constData()),
+                   decoded, records);
+      decoded += records;
+      data.remove(0, records * stride);
+      emit loadProgress(decoded * propertyCount);
+    }
+
+    if(decoded == count) break;
+
+    QByteArray block = decompressor->read();
+    if(block.isEmpty())
+    {
+      QString error = decompressor->errorString();
+      clear();
+      m_errorString = error.isEmpty() ? QString("Unexpected end of file")
+                                      : error;
+      return false;
+    }
+
+    // Avoids a copy in the common case of no partial record
+    if(data.isEmpty()) data = block;
+    else data += block;
+  }
+
+  emit loadFinished();
+
+  return true;
+}
+
+bool PLYData::canLoadAscii(const PLYHeader &header)
+{
+  if(header.storageMode() != PLY_ASCII) return false;
+
+  // Records of all elements are single lines, so only the vertex properties
+  // need to be scalars
+  int element = header.elementIndex("vertex");
+  return element >= 0 && header.recordSize(element) > 0
+      && header.elements().at(element).count
+         <= std::numeric_limits<int>::max();
+}
+
+bool PLYData::loadAscii(const PLYHeader &header)
+{
+  QFile file(m_path);
+  if(!file.open(QIODevice::ReadOnly)) return false;
+
+  const qint64 size = file.size() - header.dataOffset();
+  if(size <= 0) return false;
+
+  uchar *map = file.map(header.dataOffset(), size);
+  if(!map) return false;
+
+  bool result = parseAscii(header, reinterpret_cast<const char*>(map), size);
+  file.unmap(map);
+
+  return result;
+}
+
+bool PLYData::parseAscii(const PLYHeader &header, const char *body,
+                         qint64 size)
+{
+  if(size <= 0) return false;
+
+  int element = header.elementIndex("vertex");
+  const PLYHeader::Element &vertex = header.elements().at(element);
+  const int count = vertex.count;
+
+  // Lines of preceding elements to skip
+  qint64 skip = 0;
+  for(int i = 0; i < element; ++i) skip += header.elements().at(i).count;
+
+  // Split body into chunks starting at line starts
+  const qint64 chunkSize = qMax(qint64(1 << 20),
+                                size / (QThread::idealThreadCount() * 8));
+  QVector<qint64> chunkStarts;
+  chunkStarts.push_back(0);
+  for(qint64 position = chunkSize; position < size; position += chunkSize)
+  {
+    if(position <= chunkStarts.last()) continue;
+
+    const void *newline = std::memchr(body + position, '\n', size - position);
+    if(!newline) break;
+
+    qint64 start = static_cast<const char*>(newline) - body + 1;
+    if(start < size && start > chunkStarts.last()) chunkStarts.push_back(start);
+  }
+  chunkStarts.push_back(size);
+  const int chunkCount = chunkStarts.count() - 1;
+
+  // Count lines per chunk; a final line without newline still counts
+  QVector<qint64> lineStarts(chunkCount + 1, 0);
+  qint64 *lines = lineStarts.data();
+  parallelFor(chunkCount, 1, [&](int first, int last)
+  {
+    for(int c = first; c < last; ++c)
+    {
+      const char *p = body + chunkStarts.at(c);
+      const char *end = body + chunkStarts.at(c + 1);
+      qint64 n = std::count(p, end, '\n');
+      if(end[-1] != '\n') ++n;
+      lines[c + 1] = n;
+    }
+  });
+
+  // Prefix sum gives the index of the first line of every chunk
+  for(int c = 0; c < chunkCount; ++c) lines[c + 1] += lines[c];
+
+  if(lines[chunkCount] < skip + count) return false;
+
+  m_comments = header.comments();
+
+  // Index of loaded property for each column; -1 for skipped columns.
+  // Columns after the last requested one are never tokenized.
+  QVector<float*> destinations;
+  QVector<int> columns;
+  int columnCount = 0;
+  for(int p = 0; p < vertex.properties.count(); ++p)
+  {
+    const QString &name = vertex.properties.at(p).name;
+    if(isRequested(name))
+    {
+      columns.push_back(destinations.count());
+      m_vertexProperties.push_back(name);
+      m_vertexData.push_back(QVector<float>(count));
+      destinations.push_back(m_vertexData.last().data());
+      columnCount = p + 1;
+    }
+    else
+    {
+      columns.push_back(-1);
+    }
+  }
+  const int propertyCount = destinations.count();
+
+  m_loadCanceled = false;
+  emit loadStarted(count * propertyCount);
+
+  QVector<float> chunkMinimums(chunkCount * propertyCount,
+                               std::numeric_limits<float>::max());
+  QVector<float> chunkMaximums(chunkCount * propertyCount,
+                               -std::numeric_limits<float>::max());
+  float *minimums = chunkMinimums.data();
+  float *maximums = chunkMaximums.data();
+
+  QAtomicInt failed(0);
+
+  // Each chunk parses its vertex lines straight into their final position
+  parallelFor(chunkCount, 1, [&](int first, int last)
+  {
+    for(int c = first; c < last && !failed.loadAcquire(); ++c)
+    {
+      const char *p = body + chunkStarts.at(c);
+      const char *end = body + chunkStarts.at(c + 1);
+      qint64 line = lines[c];
+
+      // Skip chunks without vertex lines
+      if(line >= skip + count || lines[c + 1] <= skip) continue;
+
+      for(; p < end && line < skip + count; ++line)
+      {
+        if(line >= skip)
+        {
+          int v = line - skip;
+          for(int column = 0; column < columnCount; ++column)
+          {
+            int property = columns.at(column);
+            if(property < 0)
+            {
+              if(skipToken(p, end)) continue;
+
+              failed.storeRelease(1);
+              return;
+            }
+
+            double value = 0;
+            if(!parseNumber(p, end, &value))
+            {
+              failed.storeRelease(1);
+              return;
+            }
+
+            destinations[property][v] = value;
+            float &minimum = minimums[c * propertyCount + property];
+            float &maximum = maximums[c * propertyCount + property];
+            if(value < minimum) minimum = value;
+            if(value > maximum) maximum = value;
+          }
+        }
+
+        // Advance to next line
+        const void *newline = std::memchr(p, '\n', end - p);
+        p = newline ? static_cast<const char*>(newline) + 1 : end;
+      }
+    }
+  });
+
+  if(failed.loadAcquire()) return false;
+
+  // Combine chunk results
+  for(int p = 0; p < propertyCount; ++p)
+  {
+    float minimum = std::numeric_limits<float>::max();
+    float maximum = -std::numeric_limits<float>::max();
+    for(int c = 0; c < chunkCount; ++c)
+    {
+      minimum = qMin(minimum, minimums[c * propertyCount + p]);
+      maximum = qMax(maximum, maximums[c * propertyCount + p]);
+    }
+    m_minimums.push_back(minimum);
+    m_maximums.push_back(maximum);
+  }
+
+  emit loadProgress(count * propertyCount);
+  emit loadFinished();
+
+  return true;
+}
+
 void PLYData::errorCallback(p_ply ply, const char *message)
 {
   PLYData* pdata = NULL;
@@ -245,11 +955,12 @@ int PLYData::vertexCallback(p_ply_argument arg)
   double value = ply_get_argument_value(arg);
   pdata->m_vertexData[propertyIndex].push_back(value);
 
-  // Update min/max
+  // Update min/max; the first value can be both
   if(value < (pdata->m_minimums[propertyIndex]))
   {
     pdata->m_minimums[propertyIndex] = value;
-  } else if(value > (pdata->m_maximums[propertyIndex]))
+  }
+  if(value > (pdata->m_maximums[propertyIndex]))
   {
     pdata->m_maximums[propertyIndex] = value;
   }
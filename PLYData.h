@@ -6,8 +6,11 @@
 #include <QStringList>
 #include <QTime>
 #include <QVector>
+#include "PLYHeader.h"
 #include "rply.h"
 
+class Decompressor;
+
 class PLYData : public QObject
 {
   Q_OBJECT
@@ -33,6 +36,28 @@ public:
   // Vertex property names
   const QStringList& vertexProperties() const { return m_vertexProperties; }
 
+  // Restrict loading to the named vertex properties.  Other properties are
+  // skipped while parsing and not listed in vertexProperties().  An empty
+  // list, the default, loads all properties.
+  void setRequestedProperties(const QStringList& properties)
+  {
+    m_requestedProperties = properties;
+  }
+  const QStringList& requestedProperties() const
+  {
+    return m_requestedProperties;
+  }
+
+  // Restrict loading to count vertices starting at first, so a file larger
+  // than memory can be read in blocks.  A negative count, the default, loads
+  // to the end.  Only binary files with fixed-size vertex records support
+  // ranges; load() fails for others.
+  void setVertexRange(qint64 first, int count)
+  {
+    m_rangeFirst = first;
+    m_rangeCount = count;
+  }
+
   // Vertex data
   const QVector<float>& vertexData(const QString& property) const;
   int vertexCount() const;
@@ -76,6 +101,13 @@ private:
   // Vertex property names
   QStringList m_vertexProperties;
 
+  // Vertex properties to load; empty for all
+  QStringList m_requestedProperties;
+
+  // First vertex and number of vertices to load; negative count for all
+  qint64 m_rangeFirst;
+  int m_rangeCount;
+
   // Data for each property
   QVector< QVector<float> > m_vertexData;
 
@@ -95,6 +127,58 @@ private:
   // Number of items to load between progress updates
   int m_progressInterval;
 
+  // Discard data of a previous load
+  void clear();
+
+  bool isRequested(const QString& property) const
+  {
+    return m_requestedProperties.isEmpty()
+        || m_requestedProperties.contains(property);
+  }
+
+  // Where each loaded property is found in a binary vertex record
+  struct BinaryLayout
+  {
+    int stride;
+    bool swap;
+    QVector<float*> destinations;
+    QVector<int> offsets;
+    QVector<e_ply_type> types;
+  };
+
+  // First vertex and number of vertices of the requested range.  Returns
+  // false if the range is too large to load.
+  bool vertexRange(const PLYHeader& header, qint64 *first, int *count);
+
+  // Allocates count values of each requested vertex property
+  void allocateBinary(const PLYHeader& header, int count,
+                      BinaryLayout *layout);
+
+  // Decodes count records in parallel into vertices starting at first,
+  // extending the minimum and maximum of each property
+  void decodeBinary(const BinaryLayout& layout, const uchar *records,
+                    int first, int count);
+
+  // Decodes binary files with fixed-size vertex records directly from a
+  // memory map instead of through rply callbacks
+  static bool canLoadBinary(const PLYHeader& header);
+  bool loadBinary(const PLYHeader& header);
+
+  // Parses ASCII files in parallel over newline-aligned chunks.  Returns
+  // false without reporting an error if the body contains anything the fast
+  // parser does not handle, so the caller can fall back to rply.
+  static bool canLoadAscii(const PLYHeader& header);
+  bool loadAscii(const PLYHeader& header);
+  bool parseAscii(const PLYHeader& header, const char *body, qint64 size);
+
+  // Loads gzip or zstd compressed files while a pool thread decompresses
+  // them.  Binary vertex records are decoded block by block as they arrive;
+  // ASCII bodies are gathered and parsed once complete.  Other files are
+  // not supported.
+  bool loadCompressed();
+  bool loadCompressedBinary(const PLYHeader& header,
+                            Decompressor *decompressor, QByteArray data);
+
   // Callbacks
   static void errorCallback(p_ply ply, const char *message);
   static int vertexCallback(p_ply_argument arg);
@@ -0,0 +1,209 @@
+#include <QFile>
+#include "PLYHeader.h"
+
+PLYHeader::PLYHeader() : m_storageMode(PLY_DEFAULT), m_dataOffset(0)
+{
+}
+
+bool PLYHeader::read(const QString &path)
+{
+  QFile file(path);
+  if(!file.open(QIODevice::ReadOnly))
+  {
+    m_errorString = "Unable to open file";
+    return false;
+  }
+
+  return read(&file);
+}
+
+bool PLYHeader::read(QIODevice *device)
+{
+  m_storageMode = PLY_DEFAULT;
+  m_comments.clear();
+  m_elements.clear();
+  m_errorString.clear();
+
+  // Lines are split on any whitespace; strips \r from dos mode files
+  QByteArray line = device->readLine().trimmed();
+  if(line != "ply")
+  {
+    m_errorString = "Not a PLY file";
+    return false;
+  }
+
+  for(;;)
+  {
+    if(device->atEnd())
+    {
+      m_errorString = "Unexpected end of header";
+      return false;
+    }
+
+    line = device->readLine();
+    QString text = QString::fromLatin1(line).trimmed();
+    QStringList words = text.simplified().split(' ');
+    const QString& keyword = words.first();
+
+    if(keyword == "end_header") break;
+
+    if(keyword == "format" && words.count() == 3)
+    {
+      if(words.at(1) == "ascii") m_storageMode = PLY_ASCII;
+      else if(words.at(1) == "binary_little_endian")
+        m_storageMode = PLY_LITTLE_ENDIAN;
+      else if(words.at(1) == "binary_big_endian")
+        m_storageMode = PLY_BIG_ENDIAN;
+    }
+    else if(keyword == "comment")
+    {
+      m_comments.push_back(text.mid(keyword.length()).trimmed());
+    }
+    else if(keyword == "element" && words.count() == 3)
+    {
+      Element element;
+      element.name = words.at(1);
+      bool ok = false;
+      element.count = words.at(2).toLongLong(&ok);
+      if(!ok)
+      {
+        m_errorString = "Invalid element count";
+        return false;
+      }
+      m_elements.push_back(element);
+    }
+    else if(keyword == "property" && !m_elements.isEmpty())
+    {
+      Property property;
+      property.lengthType = PLY_LIST;
+      property.valueType = PLY_LIST;
+
+      bool ok = false;
+      if(words.count() == 5 && words.at(1) == "list")
+      {
+        property.type = PLY_LIST;
+        property.name = words.at(4);
+        ok = parseType(words.at(2), &property.lengthType)
+            && parseType(words.at(3), &property.valueType);
+      }
+      else if(words.count() == 3)
+      {
+        property.name = words.at(2);
+        ok = parseType(words.at(1), &property.type);
+      }
+
+      if(!ok)
+      {
+        m_errorString = "Invalid property: " + text;
+        return false;
+      }
+      m_elements.last().properties.push_back(property);
+    }
+    else if(keyword != "obj_info" && !keyword.isEmpty())
+    {
+      m_errorString = "Invalid header line: " + text;
+      return false;
+    }
+  }
+
+  if(m_storageMode == PLY_DEFAULT)
+  {
+    m_errorString = "Invalid file format";
+    return false;
+  }
+
+  m_dataOffset = device->pos();
+
+  return true;
+}
+
+int PLYHeader::elementIndex(const QString &name) const
+{
+  for(int i = 0; i < m_elements.count(); ++i)
+    if(m_elements.at(i).name == name) return i;
+
+  return -1;
+}
+
+int PLYHeader::propertyIndex(int element, const QString &name) const
+{
+  const QVector<Property>& properties = m_elements.at(element).properties;
+  for(int i = 0; i < properties.count(); ++i)
+    if(properties.at(i).name == name) return i;
+
+  return -1;
+}
+
+int PLYHeader::recordSize(int element) const
+{
+  int size = 0;
+  for(const Property& property: m_elements.at(element).properties)
+  {
+    if(property.type == PLY_LIST) return -1;
+    size += typeSize(property.type);
+  }
+
+  return size;
+}
+
+int PLYHeader::propertyOffset(int element, int property) const
+{
+  int offset = 0;
+  for(int i = 0; i < property; ++i)
+    offset += typeSize(m_elements.at(element).properties.at(i).type);
+
+  return offset;
+}
+
+qint64 PLYHeader::elementOffset(int element) const
+{
+  qint64 offset = m_dataOffset;
+  for(int i = 0; i < element; ++i)
+  {
+    int size = recordSize(i);
+    if(size < 0) return -1;
+    offset += size * m_elements.at(i).count;
+  }
+
+  return offset;
+}
+
+int PLYHeader::typeSize(e_ply_type type)
+{
+  switch(type)
+  {
+  case PLY_INT8: case PLY_UINT8: case PLY_CHAR: case PLY_UCHAR:
+    return 1;
+  case PLY_INT16: case PLY_UINT16: case PLY_SHORT: case PLY_USHORT:
+    return 2;
+  case PLY_INT32: case PLY_UIN32: case PLY_INT: case PLY_UINT:
+  case PLY_FLOAT32: case PLY_FLOAT:
+    return 4;
+  case PLY_FLOAT64: case PLY_DOUBLE:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+bool PLYHeader::parseType(const QString &name, e_ply_type *type)
+{
+  // Names in order of e_ply_type
+  static const char *const names[] = {
+    "int8", "uint8", "int16", "uint16",
+    "int32", "uint32", "float32", "float64",
+    "char", "uchar", "short", "ushort",
+    "int", "uint", "float", "double"
+  };
+
+  for(int i = 0; i < PLY_LIST; ++i)
+  {
+    if(name == names[i])
+    {
+      *type = e_ply_type(i);
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,76 @@
+#ifndef PLYHEADER_H
+#define PLYHEADER_H
+#include <QIODevice>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include "rply.h"
+
+// Parsed PLY header.  Gives the storage mode and the layout of elements so
+// the body can be decoded without going through rply's per-value callbacks.
+class PLYHeader
+{
+public:
+  struct Property
+  {
+    QString name;
+    // Scalar type, or PLY_LIST with lengthType and valueType set
+    e_ply_type type;
+    e_ply_type lengthType;
+    e_ply_type valueType;
+  };
+
+  struct Element
+  {
+    QString name;
+    qint64 count;
+    QVector<Property> properties;
+  };
+
+  PLYHeader();
+
+  // Reads header from start of file or device.  Returns false if the header
+  // is malformed; errorString() describes the problem.
+  bool read(const QString& path);
+  bool read(QIODevice *device);
+
+  QString errorString() const { return m_errorString; }
+
+  e_ply_storage_mode storageMode() const { return m_storageMode; }
+  const QStringList& comments() const { return m_comments; }
+  const QVector<Element>& elements() const { return m_elements; }
+
+  // Index of named element; -1 if not present
+  int elementIndex(const QString& name) const;
+
+  // Index of named property of an element; -1 if not present
+  int propertyIndex(int element, const QString& name) const;
+
+  // Byte offset of the body from the start of the file
+  qint64 dataOffset() const { return m_dataOffset; }
+
+  // Size in bytes of one binary record of element; -1 if the element has
+  // list properties and thus variable-size records
+  int recordSize(int element) const;
+
+  // Byte offset of a property within a binary record of element
+  int propertyOffset(int element, int property) const;
+
+  // Byte offset of the first record of element in a binary file; -1 if a
+  // preceding element has variable-size records
+  qint64 elementOffset(int element) const;
+
+  // Size in bytes of a scalar type
+  static int typeSize(e_ply_type type);
+
+private:
+  static bool parseType(const QString& name, e_ply_type *type);
+
+  QString m_errorString;
+  e_ply_storage_mode m_storageMode;
+  QStringList m_comments;
+  QVector<Element> m_elements;
+  qint64 m_dataOffset;
+};
+
+#endif // PLYHEADER_H
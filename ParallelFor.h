@@ -0,0 +1,32 @@
+#ifndef PARALLELFOR_H
+#define PARALLELFOR_H
+#include <QPair>
+#include <QThread>
+#include <QVector>
+#include <QtConcurrent>
+
+// Splits [0, count) into ranges of at most blockSize items and calls
+// f(begin, end) for each range on the global thread pool.  Blocks until all
+// ranges are processed.  f must be safe to call concurrently.
+template<typename F>
+void parallelFor(int count, int blockSize, F f)
+{
+  if(count <= 0) return;
+
+  QVector< QPair<int, int> > ranges;
+  for(int begin = 0; begin < count; begin += blockSize)
+    ranges.push_back(qMakePair(begin, qMin(begin + blockSize, count)));
+
+  QtConcurrent::blockingMap(ranges, [&f](const QPair<int, int>& range)
+  {
+    f(range.first, range.second);
+  });
+}
+
+// Block size giving each pool thread several ranges for load balancing
+inline int parallelBlockSize(int count, int minimum = 1)
+{
+  return qMax(minimum, count / (QThread::idealThreadCount() * 8) + 1);
+}
+
+#endif // PARALLELFOR_H
@@ -0,0 +1,508 @@
+#include <QFile>
+#include <QSaveFile>
+#include "ParallelFor.h"
+#include "PointCloud.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+  const char magic[8] = { 'D', 'S', 'M', 'P', 'O', 'I', 'N', 'T' };
+  const quint32 version = 3;
+
+  enum Storage
+  {
+    FloatStorage = 0,
+    QuantizedStorage = 1
+  };
+
+  struct Header
+  {
+    char magic[8];
+    quint32 version;
+    quint32 count;
+    quint32 chunkCount;
+    quint32 storage;
+    float minimum[3];
+    float maximum[3];
+    double scale;
+    char sourceHash[20];
+    quint32 reserved;
+  };
+
+  struct ChunkRecord
+  {
+    quint32 begin;
+    quint32 count;
+    float minimum[3];
+    float maximum[3];
+    double origin[3];
+  };
+
+  // Largest extent of a chunk in quantized units
+  const qint64 offsetRange = 65535;
+
+  // Spreads the low 21 bits of v so two zero bits follow each bit
+  quint64 spreadBits(quint64 v)
+  {
+    v &= 0x1fffff;
+    v = (v | v << 32) & Q_UINT64_C(0x1f00000000ffff);
+    v = (v | v << 16) & Q_UINT64_C(0x1f0000ff0000ff);
+    v = (v | v << 8)  & Q_UINT64_C(0x100f00f00f00f00f);
+    v = (v | v << 4)  & Q_UINT64_C(0x10c30c30c30c30c3);
+    v = (v | v << 2)  & Q_UINT64_C(0x1249249249249249);
+    return v;
+  }
+
+  // Cell of a coordinate on a 2^21 grid over [minimum, maximum]
+  quint64 gridCell(float value, float minimum, float maximum)
+  {
+    const double cells = double(1 << 21);
+    double extent = double(maximum) - double(minimum);
+    if(extent <= 0.0) return 0;
+
+    double cell = (double(value) - double(minimum)) / extent * cells;
+    return quint64(qBound(0.0, cell, cells - 1.0));
+  }
+}
+
+PointCloud::PointCloud() : m_count(0), m_x(0), m_y(0), m_z(0),
+  m_quantized(0), m_scale(0.0)
+{
+}
+
+PointCloud PointCloud::fromPLY(const PLYData &ply, int chunkSize)
+{
+  PointCloud cloud;
+  cloud.setOwned(ply.vertexData("x"), ply.vertexData("y"),
+                 ply.vertexData("z"));
+  cloud.m_minimum = QVector3D(ply.minimum("x"), ply.minimum("y"),
+                              ply.minimum("z"));
+  cloud.m_maximum = QVector3D(ply.maximum("x"), ply.maximum("y"),
+                              ply.maximum("z"));
+  cloud.buildChunks(chunkSize);
+
+  return cloud;
+}
+
+PointCloud PointCloud::fromLAS(const LASData &las, int chunkSize)
+{
+  PointCloud cloud;
+  cloud.setOwned(las.x(), las.y(), las.z());
+  cloud.m_minimum = las.minimum();
+  cloud.m_maximum = las.maximum();
+  cloud.buildChunks(chunkSize);
+
+  return cloud;
+}
+
+PointCloud PointCloud::merge(const QVector<PointCloud> &clouds)
+{
+  PointCloud merged;
+
+  // Index of the first point of each cloud in the merged arrays
+  QVector<int> offsets;
+  int count = 0;
+  for(const PointCloud& cloud: clouds)
+  {
+    offsets.push_back(count);
+    count += cloud.count();
+
+    if(cloud.isNull()) continue;
+    if(cloud.isQuantized()) return PointCloud();
+
+    for(int j = 0; j < 3; ++j)
+    {
+      bool first = merged.m_chunks.isEmpty();
+      merged.m_minimum[j] = first
+          ? cloud.m_minimum[j] : qMin(merged.m_minimum[j], cloud.m_minimum[j]);
+      merged.m_maximum[j] = first
+          ? cloud.m_maximum[j] : qMax(merged.m_maximum[j], cloud.m_maximum[j]);
+    }
+
+    for(Chunk chunk: cloud.m_chunks)
+    {
+      chunk.begin += offsets.last();
+      merged.m_chunks.push_back(chunk);
+    }
+  }
+
+  QVector<float> x(count), y(count), z(count);
+  float *destinations[3] = { x.data(), y.data(), z.data() };
+
+  parallelFor(clouds.count(), 1, [&](int begin, int end)
+  {
+    for(int c = begin; c < end; ++c)
+    {
+      const PointCloud& cloud = clouds.at(c);
+      const float *sources[3] = { cloud.m_x, cloud.m_y, cloud.m_z };
+      for(int j = 0; j < 3 && !cloud.isNull(); ++j)
+      {
+        std::memcpy(destinations[j] + offsets.at(c), sources[j],
+                    size_t(cloud.count()) * sizeof(float));
+      }
+    }
+  });
+
+  merged.setOwned(x, y, z);
+
+  return merged;
+}
+
+PointCloud PointCloud::load(const QString &path)
+{
+  QSharedPointer<QFile> file(new QFile(path));
+  if(!file->open(QIODevice::ReadOnly)) return PointCloud();
+
+  qint64 size = file->size();
+  if(size < qint64(sizeof(Header))) return PointCloud();
+
+  uchar *map = file->map(0, size);
+  if(!map) return PointCloud();
+
+  Header header;
+  std::memcpy(&header, map, sizeof(Header));
+
+  if(std::memcmp(header.magic, magic, sizeof(magic)) != 0
+     || header.version != version
+     || header.count > quint32(std::numeric_limits<int>::max())
+     || (header.storage != FloatStorage && header.storage != QuantizedStorage))
+    return PointCloud();
+
+  bool quantized = header.storage == QuantizedStorage;
+  qint64 chunkOffset = sizeof(Header);
+  qint64 pointOffset = chunkOffset
+      + qint64(header.chunkCount) * qint64(sizeof(ChunkRecord));
+  qint64 expected = pointOffset + 3 * qint64(header.count)
+      * qint64(quantized ? sizeof(quint16) : sizeof(float));
+  if(size != expected) return PointCloud();
+
+  PointCloud cloud;
+  cloud.m_count = int(header.count);
+  cloud.m_scale = header.scale;
+  QByteArray sourceHash(header.sourceHash, sizeof(header.sourceHash));
+  if(sourceHash != QByteArray(sizeof(header.sourceHash), '\0'))
+    cloud.m_sourceHash = sourceHash;
+  cloud.m_minimum = QVector3D(header.minimum[0], header.minimum[1],
+                              header.minimum[2]);
+  cloud.m_maximum = QVector3D(header.maximum[0], header.maximum[1],
+                              header.maximum[2]);
+
+  // Chunk index is small and copied; point arrays are used in place
+  cloud.m_chunks.resize(int(header.chunkCount));
+  for(int i = 0; i < cloud.m_chunks.count(); ++i)
+  {
+    ChunkRecord record;
+    std::memcpy(&record, map + chunkOffset + i * qint64(sizeof(ChunkRecord)),
+                sizeof(ChunkRecord));
+    if(quint64(record.begin) + record.count > header.count)
+      return PointCloud();
+
+    Chunk& chunk = cloud.m_chunks[i];
+    chunk.begin = int(record.begin);
+    chunk.count = int(record.count);
+    chunk.bounds = Box(QVector3D(record.minimum[0], record.minimum[1],
+                                 record.minimum[2]),
+                       QVector3D(record.maximum[0], record.maximum[1],
+                                 record.maximum[2]));
+    for(int j = 0; j < 3; ++j) chunk.origin[j] = record.origin[j];
+  }
+
+  if(quantized)
+  {
+    cloud.m_quantized = reinterpret_cast<const quint16*>(map + pointOffset);
+  }
+  else
+  {
+    const float *points = reinterpret_cast<const float*>(map + pointOffset);
+    cloud.m_x = points;
+    cloud.m_y = points + cloud.m_count;
+    cloud.m_z = points + 2 * qint64(cloud.m_count);
+  }
+  cloud.m_file = file;
+
+  return cloud;
+}
+
+bool PointCloud::save(const QString &path) const
+{
+  Header header;
+  std::memcpy(header.magic, magic, sizeof(magic));
+  header.version = version;
+  header.count = quint32(m_count);
+  header.chunkCount = quint32(m_chunks.count());
+  header.storage = isQuantized() ? QuantizedStorage : FloatStorage;
+  header.scale = m_scale;
+  std::memset(header.sourceHash, 0, sizeof(header.sourceHash));
+  std::memcpy(header.sourceHash, m_sourceHash.constData(),
+              qMin(size_t(m_sourceHash.size()), sizeof(header.sourceHash)));
+  header.reserved = 0;
+  for(int i = 0; i < 3; ++i)
+  {
+    header.minimum[i] = m_minimum[i];
+    header.maximum[i] = m_maximum[i];
+  }
+
+  QVector<ChunkRecord> records(m_chunks.count());
+  for(int i = 0; i < m_chunks.count(); ++i)
+  {
+    const Chunk& chunk = m_chunks.at(i);
+    ChunkRecord& record = records[i];
+    record.begin = quint32(chunk.begin);
+    record.count = quint32(chunk.count);
+    for(int j = 0; j < 3; ++j)
+    {
+      record.minimum[j] = chunk.bounds.minimum()[j];
+      record.maximum[j] = chunk.bounds.maximum()[j];
+      record.origin[j] = chunk.origin[j];
+    }
+  }
+
+  // Written to a temporary file and renamed on commit
+  QSaveFile file(path);
+  if(!file.open(QIODevice::WriteOnly)) return false;
+
+  file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+  file.write(reinterpret_cast<const char*>(records.constData()),
+             qint64(records.count()) * qint64(sizeof(ChunkRecord)));
+
+  if(isQuantized())
+  {
+    file.write(reinterpret_cast<const char*>(m_quantized),
+               3 * qint64(m_count) * qint64(sizeof(quint16)));
+  }
+  else
+  {
+    qint64 arraySize = qint64(m_count) * qint64(sizeof(float));
+    file.write(reinterpret_cast<const char*>(m_x), arraySize);
+    file.write(reinterpret_cast<const char*>(m_y), arraySize);
+    file.write(reinterpret_cast<const char*>(m_z), arraySize);
+  }
+
+  return file.commit();
+}
+
+void PointCloud::sortSpatially(int chunkSize)
+{
+  if(isNull() || isQuantized()) return;
+
+  // Morton code of each point paired with its index
+  QVector< QPair<quint64, int> > order(m_count);
+  QPair<quint64, int> *orderBits = order.data();
+  const float *x = m_x, *y = m_y, *z = m_z;
+  const QVector3D min = m_minimum, max = m_maximum;
+
+  parallelFor(m_count, parallelBlockSize(m_count, 65536),
+              [=](int begin, int end)
+  {
+    for(int i = begin; i < end; ++i)
+    {
+      quint64 code = spreadBits(gridCell(x[i], min.x(), max.x()))
+          | spreadBits(gridCell(y[i], min.y(), max.y())) << 1
+          | spreadBits(gridCell(z[i], min.z(), max.z())) << 2;
+      orderBits[i] = qMakePair(code, i);
+    }
+  });
+
+  std::sort(order.begin(), order.end());
+
+  QVector<float> sortedX(m_count), sortedY(m_count), sortedZ(m_count);
+  float *sx = sortedX.data(), *sy = sortedY.data(), *sz = sortedZ.data();
+
+  parallelFor(m_count, parallelBlockSize(m_count, 65536),
+              [=](int begin, int end)
+  {
+    for(int i = begin; i < end; ++i)
+    {
+      int source = orderBits[i].second;
+      sx[i] = x[source];
+      sy[i] = y[source];
+      sz[i] = z[source];
+    }
+  });
+
+  setOwned(sortedX, sortedY, sortedZ);
+  buildChunks(chunkSize);
+}
+
+void PointCloud::setOwned(const QVector<float> &x, const QVector<float> &y,
+                          const QVector<float> &z)
+{
+  m_ownedX = x;
+  m_ownedY = y;
+  m_ownedZ = z;
+  m_ownedQuantized.clear();
+  m_file.clear();
+
+  m_count = m_ownedX.count();
+  m_x = m_ownedX.constData();
+  m_y = m_ownedY.constData();
+  m_z = m_ownedZ.constData();
+  m_quantized = 0;
+  m_scale = 0.0;
+}
+
+void PointCloud::setOwned(const QVector<quint16> &quantized)
+{
+  m_ownedX.clear();
+  m_ownedY.clear();
+  m_ownedZ.clear();
+  m_ownedQuantized = quantized;
+  m_file.clear();
+
+  m_count = m_ownedQuantized.count() / 3;
+  m_x = m_y = m_z = 0;
+  m_quantized = m_ownedQuantized.constData();
+}
+
+bool PointCloud::quantize(double scale, int chunkSize)
+{
+  if(isNull() || isQuantized() || scale <= 0.0) return false;
+
+  const double origin[3] = { m_minimum.x(), m_minimum.y(), m_minimum.z() };
+  const float *coordinates[3] = { m_x, m_y, m_z };
+  const int count = m_count;
+
+  // Global grid cell of coordinate j of point i; computed where needed so no
+  // cell array as large as the cloud is kept
+  auto cellOf = [=](int i, int j)
+  {
+    return qRound64((coordinates[j][i] - origin[j]) / scale);
+  };
+
+  // Chunks of consecutive points whose cells span at most offsetRange
+  QVector<Chunk> chunks;
+  qint64 low[3] = { 0, 0, 0 }, high[3] = { 0, 0, 0 };
+  for(int i = 0; i < count; ++i)
+  {
+    qint64 cell[3] = { cellOf(i, 0), cellOf(i, 1), cellOf(i, 2) };
+
+    bool split = chunks.isEmpty() || chunks.last().count == chunkSize;
+    for(int j = 0; j < 3 && !split; ++j)
+      split = qMax(high[j], cell[j]) - qMin(low[j], cell[j]) > offsetRange;
+
+    if(split)
+    {
+      Chunk chunk;
+      chunk.begin = i;
+      chunk.count = 0;
+      chunks.push_back(chunk);
+      for(int j = 0; j < 3; ++j) low[j] = high[j] = cell[j];
+    }
+
+    ++chunks.last().count;
+    for(int j = 0; j < 3; ++j)
+    {
+      low[j] = qMin(low[j], cell[j]);
+      high[j] = qMax(high[j], cell[j]);
+    }
+  }
+
+  // Offsets from the lowest cell of each chunk; bounds are of decoded points
+  QVector<quint16> quantized(3 * count);
+  quint16 *quantizedBits = quantized.data();
+  Chunk *chunkBits = chunks.data();
+  parallelFor(chunks.count(), parallelBlockSize(chunks.count()),
+              [=](int begin, int end)
+  {
+    for(int c = begin; c < end; ++c)
+    {
+      Chunk& chunk = chunkBits[c];
+      int last = chunk.begin + chunk.count;
+
+      qint64 base[3], top[3];
+      for(int j = 0; j < 3; ++j)
+      {
+        base[j] = top[j] = cellOf(chunk.begin, j);
+        for(int i = chunk.begin + 1; i < last; ++i)
+        {
+          qint64 cell = cellOf(i, j);
+          base[j] = qMin(base[j], cell);
+          top[j] = qMax(top[j], cell);
+        }
+
+        for(int i = chunk.begin; i < last; ++i)
+          quantizedBits[3 * qint64(i) + j] = quint16(cellOf(i, j) - base[j]);
+
+        chunk.origin[j] = origin[j] + base[j] * scale;
+      }
+
+      chunk.bounds = Box(QVector3D(float(chunk.origin[0]),
+                                   float(chunk.origin[1]),
+                                   float(chunk.origin[2])),
+                         QVector3D(float(origin[0] + top[0] * scale),
+                                   float(origin[1] + top[1] * scale),
+                                   float(origin[2] + top[2] * scale)));
+    }
+  });
+
+  setOwned(quantized);
+  m_scale = scale;
+  m_chunks = chunks;
+
+  m_minimum = m_chunks.first().bounds.minimum();
+  m_maximum = m_chunks.first().bounds.maximum();
+  for(const Chunk& chunk: m_chunks)
+  {
+    for(int j = 0; j < 3; ++j)
+    {
+      m_minimum[j] = qMin(m_minimum[j], chunk.bounds.minimum()[j]);
+      m_maximum[j] = qMax(m_maximum[j], chunk.bounds.maximum()[j]);
+    }
+  }
+
+  return true;
+}
+
+QVector3D PointCloud::quantizedPoint(int i) const
+{
+  // Last chunk beginning at or before i
+  auto next = std::upper_bound(m_chunks.constBegin(), m_chunks.constEnd(), i,
+                               [](int index, const Chunk& chunk)
+  {
+    return index < chunk.begin;
+  });
+  const Chunk& chunk = *(next - 1);
+
+  const quint16 *q = m_quantized + 3 * qint64(i);
+  return QVector3D(float(chunk.origin[0] + m_scale * q[0]),
+                   float(chunk.origin[1] + m_scale * q[1]),
+                   float(chunk.origin[2] + m_scale * q[2]));
+}
+
+void PointCloud::buildChunks(int chunkSize)
+{
+  int chunkCount = (m_count + chunkSize - 1) / chunkSize;
+  m_chunks.resize(chunkCount);
+
+  Chunk *chunks = m_chunks.data();
+  const float *x = m_x, *y = m_y, *z = m_z;
+  const int count = m_count;
+
+  parallelFor(chunkCount, parallelBlockSize(chunkCount), [=](int begin, int end)
+  {
+    for(int c = begin; c < end; ++c)
+    {
+      Chunk& chunk = chunks[c];
+      chunk.begin = c * chunkSize;
+      chunk.count = qMin(chunkSize, count - chunk.begin);
+
+      QVector3D min(x[chunk.begin], y[chunk.begin], z[chunk.begin]);
+      QVector3D max = min;
+      for(int i = chunk.begin + 1, last = chunk.begin + chunk.count;
+          i < last; ++i)
+      {
+        min.setX(qMin(min.x(), x[i]));
+        min.setY(qMin(min.y(), y[i]));
+        min.setZ(qMin(min.z(), z[i]));
+        max.setX(qMax(max.x(), x[i]));
+        max.setY(qMax(max.y(), y[i]));
+        max.setZ(qMax(max.z(), z[i]));
+      }
+      chunk.bounds = Box(min, max);
+      chunk.origin[0] = chunk.origin[1] = chunk.origin[2] = 0.0;
+    }
+  });
+}
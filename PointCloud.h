@@ -0,0 +1,162 @@
+#ifndef POINTCLOUD_H
+#define POINTCLOUD_H
+#include <QByteArray>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+#include <QVector3D>
+#include "Box.h"
+#include "LASData.h"
+#include "PLYData.h"
+
+class QFile;
+
+// Point positions grouped into chunks of consecutive points with bounding
+// boxes.  Positions are stored either as separate x, y and z float arrays or
+// quantized: a 16-bit unsigned offset per coordinate from the origin of the
+// point's chunk, in units of a global scale.  Storage is either owned or
+// memory-mapped from a point cache file.
+//
+// Point cache file layout:
+//
+//   offset  size  contents
+//   0       8     magic "DSMPOINT"
+//   8       4     format version, currently 3
+//   12      4     number of points n
+//   16      4     number of chunks c
+//   20      4     storage; 0 for float, 1 for quantized
+//   24      12    minimum x, y, z as floats
+//   36      12    maximum x, y, z as floats
+//   48      8     quantization scale as double; 0 for float storage
+//   56      20    SHA-1 hash of the source of the points; zero if unknown
+//   76      4     reserved, 0
+//   80      56*c  chunk index; first point, point count, minimum x, y, z and
+//                 maximum x, y, z as floats, and quantization origin x, y, z
+//                 as doubles of each chunk
+//   ...     12*n  float storage: x of each point, followed likewise by y
+//                 and z
+//           6*n   quantized storage: x, y and z offsets of each point
+//
+// All values are in host byte order.
+class PointCloud
+{
+public:
+  struct Chunk
+  {
+    int begin;
+    int count;
+    Box bounds;
+    // Position of a zero offset; only used by quantized clouds
+    double origin[3];
+  };
+
+  PointCloud();
+
+  // Shares x, y and z of loaded PLY data; chunks follow file order
+  static PointCloud fromPLY(const PLYData& ply, int chunkSize = 4096);
+
+  // Shares x, y and z of loaded LAS data; chunks follow file order
+  static PointCloud fromLAS(const LASData& las, int chunkSize = 4096);
+
+  // Concatenates float clouds, keeping their chunks.  Bounds are the union
+  // of the clouds' bounds.  Quantized clouds are not supported.
+  static PointCloud merge(const QVector<PointCloud>& clouds);
+
+  // Memory-maps a point cache file; returns null cloud on failure
+  static PointCloud load(const QString& path);
+
+  // Writes point cache file.  Returns false on failure.
+  bool save(const QString& path) const;
+
+  bool isNull() const { return m_count == 0; }
+
+  int count() const { return m_count; }
+
+  // Position of point i.  Looks up the chunk of quantized points; passes over
+  // many points should use forEach() instead.
+  QVector3D point(int i) const
+  {
+    if(m_quantized) return quantizedPoint(i);
+    return QVector3D(m_x[i], m_y[i], m_z[i]);
+  }
+
+  // Calls f(index, position) for each point of chunk
+  template<typename F>
+  void forEach(const Chunk& chunk, F f) const
+  {
+    int end = chunk.begin + chunk.count;
+    if(m_quantized)
+    {
+      for(int i = chunk.begin; i < end; ++i)
+      {
+        const quint16 *q = m_quantized + 3 * qint64(i);
+        f(i, QVector3D(float(chunk.origin[0] + m_scale * q[0]),
+                       float(chunk.origin[1] + m_scale * q[1]),
+                       float(chunk.origin[2] + m_scale * q[2])));
+      }
+    }
+    else
+    {
+      for(int i = chunk.begin; i < end; ++i)
+        f(i, QVector3D(m_x[i], m_y[i], m_z[i]));
+    }
+  }
+
+  QVector3D minimum() const { return m_minimum; }
+  QVector3D maximum() const { return m_maximum; }
+
+  const QVector<Chunk>& chunks() const { return m_chunks; }
+
+  // Reorders points along a Morton curve so chunks are spatially compact.
+  // Only float clouds are reordered; sort before quantizing.
+  void sortSpatially(int chunkSize = 4096);
+
+  // Identifies what the points were loaded from, so a cloud loaded from a
+  // point cache keeps the identity of its source files.  Empty if unknown.
+  QByteArray sourceHash() const { return m_sourceHash; }
+  void setSourceHash(const QByteArray& hash) { m_sourceHash = hash; }
+
+  bool isQuantized() const { return m_quantized != 0; }
+  double scale() const { return m_scale; }
+
+  // Converts float positions to 16-bit offsets in units of scale.  Chunks
+  // hold at most chunkSize consecutive points and are split where their
+  // extent would not fit the offsets, so spatially sorted clouds quantize
+  // into the fewest chunks.  Returns false if the cloud is empty, already
+  // quantized, or scale is not positive.
+  bool quantize(double scale, int chunkSize = 4096);
+
+private:
+  // Point arrays owned by the cloud; pointers are set to these or into a
+  // mapped file
+  void setOwned(const QVector<float>& x, const QVector<float>& y,
+                const QVector<float>& z);
+  void setOwned(const QVector<quint16>& quantized);
+
+  // Splits points into chunks of consecutive points and computes bounds
+  void buildChunks(int chunkSize);
+
+  QVector3D quantizedPoint(int i) const;
+
+  int m_count;
+  const float *m_x;
+  const float *m_y;
+  const float *m_z;
+  const quint16 *m_quantized;
+  double m_scale;
+  QByteArray m_sourceHash;
+
+  QVector<float> m_ownedX;
+  QVector<float> m_ownedY;
+  QVector<float> m_ownedZ;
+  QVector<quint16> m_ownedQuantized;
+
+  // Mapped cache file; closed when the last copy is destroyed
+  QSharedPointer<QFile> m_file;
+
+  QVector3D m_minimum;
+  QVector3D m_maximum;
+  QVector<Chunk> m_chunks;
+};
+
+#endif // POINTCLOUD_H
@@ -0,0 +1,122 @@
+#include <QFile>
+#include <QTextStream>
+#include <QtMath>
+#include "SunPosition.h"
+
+SunPosition SunPosition::at(const QDateTime &time, double latitude,
+                            double longitude)
+{
+  QDateTime utc = time.toUTC();
+
+  // Julian centuries since J2000.0
+  double julianDay = utc.toMSecsSinceEpoch() / 86400000.0 + 2440587.5;
+  double t = (julianDay - 2451545.0) / 36525.0;
+
+  // Geometric mean longitude and anomaly of the sun, in degrees
+  double meanLongitude = std::fmod(280.46646
+                                   + t * (36000.76983 + t * 0.0003032), 360.0);
+  double meanAnomaly = 357.52911 + t * (35999.05029 - 0.0001537 * t);
+  double eccentricity = 0.016708634 - t * (0.000042037 + 0.0000001267 * t);
+
+  double m = qDegreesToRadians(meanAnomaly);
+  double center = std::sin(m) * (1.914602 - t * (0.004817 + 0.000014 * t))
+      + std::sin(2 * m) * (0.019993 - 0.000101 * t)
+      + std::sin(3 * m) * 0.000289;
+
+  // Apparent longitude corrected for nutation and aberration
+  double omega = qDegreesToRadians(125.04 - 1934.136 * t);
+  double apparentLongitude = qDegreesToRadians(meanLongitude + center
+                                               - 0.00569
+                                               - 0.00478 * std::sin(omega));
+
+  // Obliquity of the ecliptic
+  double meanObliquity = 23.0 + (26.0 + (21.448 - t * (46.815 + t
+                         * (0.00059 - t * 0.001813))) / 60.0) / 60.0;
+  double obliquity = qDegreesToRadians(meanObliquity
+                                       + 0.00256 * std::cos(omega));
+
+  double declination = std::asin(std::sin(obliquity)
+                                 * std::sin(apparentLongitude));
+
+  // Equation of time in minutes
+  double y = std::tan(obliquity / 2.0);
+  y *= y;
+  double l0 = qDegreesToRadians(meanLongitude);
+  double equationOfTime = 4.0 * qRadiansToDegrees(
+        y * std::sin(2 * l0)
+        - 2 * eccentricity * std::sin(m)
+        + 4 * eccentricity * y * std::sin(m) * std::cos(2 * l0)
+        - 0.5 * y * y * std::sin(4 * l0)
+        - 1.25 * eccentricity * eccentricity * std::sin(2 * m));
+
+  // True solar time in minutes and hour angle in degrees
+  double minutes = utc.time().msecsSinceStartOfDay() / 60000.0;
+  double solarTime = std::fmod(minutes + equationOfTime + 4.0 * longitude,
+                               1440.0);
+  if(solarTime < 0) solarTime += 1440.0;
+  double hourAngle = solarTime / 4.0 - 180.0;
+
+  double lat = qDegreesToRadians(latitude);
+  double cosZenith = std::sin(lat) * std::sin(declination)
+      + std::cos(lat) * std::cos(declination)
+      * std::cos(qDegreesToRadians(hourAngle));
+  double zenith = std::acos(qBound(-1.0, cosZenith, 1.0));
+
+  // Azimuth clockwise from north
+  double azimuth = 0;
+  double denominator = std::cos(lat) * std::sin(zenith);
+  if(qAbs(denominator) > 0.001)
+  {
+    double cosAzimuth = (std::sin(lat) * std::cos(zenith)
+                         - std::sin(declination)) / denominator;
+    azimuth = 180.0 - qRadiansToDegrees(std::acos(qBound(-1.0, cosAzimuth,
+                                                         1.0)));
+    if(hourAngle > 0) azimuth = -azimuth;
+  } else {
+    azimuth = latitude > 0 ? 180.0 : 0.0;
+  }
+  if(azimuth < 0) azimuth += 360.0;
+
+  return SunPosition(azimuth, 90.0 - qRadiansToDegrees(zenith));
+}
+
+QVector<SunPosition> SunPosition::load(const QString &path)
+{
+  // Open file path for text reading
+  QFile file(path);
+  if(file.open(QIODevice::ReadOnly | QIODevice::Text))
+    return load(&file);
+
+  // On failure return empty list
+  return QVector<SunPosition>();
+}
+
+QVector<SunPosition> SunPosition::load(QIODevice *device)
+{
+  QVector<SunPosition> result;
+
+  // Ensure device is valid and opened for reading
+  if(!device || !device->isOpen()) return result;
+
+  QTextStream stream(device);
+  while(!stream.atEnd())
+  {
+    QString line = stream.readLine().trimmed();
+
+    // Skip blank and comment lines
+    if(line.isEmpty() || line.startsWith("#")) continue;
+
+    // Parse azimuth and elevation
+    QTextStream lineStream(&line);
+    double azimuth = 0;
+    double elevation = 0;
+    lineStream >> azimuth >> elevation;
+
+    if(lineStream.status() != QTextStream::Ok)
+      return QVector<SunPosition>();
+
+    result.push_back(SunPosition(azimuth, elevation));
+  }
+
+  return result;
+}
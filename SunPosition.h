@@ -0,0 +1,38 @@
+#ifndef SUNPOSITION_H
+#define SUNPOSITION_H
+#include <QDateTime>
+#include <QIODevice>
+#include <QString>
+#include <QVector>
+
+// Sun direction as azimuth (clockwise from north) and elevation above the
+// horizon, both in degrees.
+class SunPosition
+{
+public:
+  SunPosition() : m_azimuth(0), m_elevation(0) { }
+  SunPosition(double azimuth, double elevation) :
+    m_azimuth(azimuth), m_elevation(elevation) { }
+
+  double azimuth() const { return m_azimuth; }
+  double elevation() const { return m_elevation; }
+
+  bool isAboveHorizon() const { return m_elevation > 0; }
+
+  // Solar position at a time for latitude and longitude in degrees, using
+  // the NOAA solar calculator approximations.
+  static SunPosition at(const QDateTime& time, double latitude,
+                        double longitude);
+
+  // Load list of positions, one "azimuth elevation" pair per line.  Blank
+  // lines and lines starting with # are skipped.  Returns an empty list on
+  // failure.
+  static QVector<SunPosition> load(const QString& path);
+  static QVector<SunPosition> load(QIODevice *device);
+
+private:
+  double m_azimuth;
+  double m_elevation;
+};
+
+#endif // SUNPOSITION_H
@@ -0,0 +1,157 @@
+#include <QFile>
+#include <QSaveFile>
+#include "ParallelFor.h"
+#include "VisibilityBuffer.h"
+
+#include <cstring>
+
+namespace
+{
+  const char magic[8] = { 'D', 'S', 'M', 'V', 'I', 'S', 'I', 'B' };
+  const quint32 version = 1;
+
+  struct Header
+  {
+    char magic[8];
+    quint32 version;
+    quint32 width;
+    quint32 height;
+    quint32 reserved;
+    float minimum[3];
+    float maximum[3];
+    char sceneHash[20];
+    float voxelSize;
+  };
+}
+
+VisibilityBuffer::VisibilityBuffer() :
+  m_positions(0), m_depths(0), m_indices(0), m_voxelSize(0.0f)
+{
+}
+
+bool VisibilityBuffer::save(const QString &path,
+                            const Array2D<QVector3D> &positions,
+                            const Array2D<int> &indices, const Camera &camera,
+                            const QVector3D &minimum,
+                            const QVector3D &maximum,
+                            const QByteArray &sceneHash, float voxelSize)
+{
+  const int width = positions.width();
+  const int height = positions.height();
+  const qint64 count = qint64(width) * height;
+  const bool haveIndices = indices.size() == positions.size();
+
+  Header header;
+  std::memset(&header, 0, sizeof(Header));
+  std::memcpy(header.magic, magic, sizeof(magic));
+  header.version = version;
+  header.width = width;
+  header.height = height;
+  for(int i = 0; i < 3; ++i)
+  {
+    header.minimum[i] = minimum[i];
+    header.maximum[i] = maximum[i];
+  }
+  if(sceneHash.size() == int(sizeof(header.sceneHash)))
+    std::memcpy(header.sceneHash, sceneHash.constData(), sceneHash.size());
+  header.voxelSize = voxelSize;
+
+  // Arrays are filled by rows in parallel before writing
+  const int pixels = int(count);
+  QVector<float> positionData(3 * pixels);
+  QVector<float> depthData(pixels);
+  QVector<qint32> indexData(pixels, -1);
+  float *positionValues = positionData.data();
+  float *depthValues = depthData.data();
+  qint32 *indexValues = indexData.data();
+  const QVector3D empty(qInf(), qInf(), qInf());
+
+  parallelFor(height, parallelBlockSize(height), [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+    {
+      for(int x = 0; x < width; ++x)
+      {
+        const qint64 i = qint64(y) * width + x;
+        const QVector3D &position = positions(x, y);
+        for(int j = 0; j < 3; ++j) positionValues[3 * i + j] = position[j];
+
+        bool isEmpty = position == empty;
+        depthValues[i] = isEmpty ? qInf() : camera.depth(position);
+        if(haveIndices && !isEmpty) indexValues[i] = indices(x, y);
+      }
+    }
+  });
+
+  // Written to a temporary file and renamed on commit
+  QSaveFile file(path);
+  if(!file.open(QIODevice::WriteOnly)) return false;
+
+  file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+  file.write(reinterpret_cast<const char*>(positionValues),
+             3 * count * qint64(sizeof(float)));
+  file.write(reinterpret_cast<const char*>(depthValues),
+             count * qint64(sizeof(float)));
+  file.write(reinterpret_cast<const char*>(indexValues),
+             count * qint64(sizeof(qint32)));
+
+  return file.commit();
+}
+
+VisibilityBuffer VisibilityBuffer::load(const QString &path)
+{
+  QSharedPointer<QFile> file(new QFile(path));
+  if(!file->open(QIODevice::ReadOnly)) return VisibilityBuffer();
+
+  qint64 size = file->size();
+  if(size < qint64(sizeof(Header))) return VisibilityBuffer();
+
+  uchar *map = file->map(0, size);
+  if(!map) return VisibilityBuffer();
+
+  Header header;
+  std::memcpy(&header, map, sizeof(Header));
+
+  const qint64 count = qint64(header.width) * header.height;
+  if(std::memcmp(header.magic, magic, sizeof(magic)) != 0
+     || header.version != version || count == 0
+     || size != qint64(sizeof(Header)) + 20 * count)
+  {
+    return VisibilityBuffer();
+  }
+
+  VisibilityBuffer buffer;
+  buffer.m_size = QSize(int(header.width), int(header.height));
+  buffer.m_positions = reinterpret_cast<const float*>(map + sizeof(Header));
+  buffer.m_depths = buffer.m_positions + 3 * count;
+  buffer.m_indices = reinterpret_cast<const qint32*>(buffer.m_depths + count);
+  buffer.m_minimum = QVector3D(header.minimum[0], header.minimum[1],
+                               header.minimum[2]);
+  buffer.m_maximum = QVector3D(header.maximum[0], header.maximum[1],
+                               header.maximum[2]);
+
+  QByteArray hash(header.sceneHash, sizeof(header.sceneHash));
+  if(hash != QByteArray(sizeof(header.sceneHash), 0))
+    buffer.m_sceneHash = hash;
+  buffer.m_voxelSize = header.voxelSize;
+
+  buffer.m_file = file;
+
+  return buffer;
+}
+
+Array2D<QVector3D> VisibilityBuffer::positions() const
+{
+  Array2D<QVector3D> result(m_size);
+  QVector3D *values = result.bits();
+  const int width = m_size.width();
+
+  parallelFor(height(), parallelBlockSize(height()), [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+      for(int x = 0; x < width; ++x)
+        values[qint64(y) * width + x] = position(x, y);
+  });
+
+  return result;
+}
@@ -0,0 +1,103 @@
+#ifndef VISIBILITYBUFFER_H
+#define VISIBILITYBUFFER_H
+#include <QByteArray>
+#include <QSharedPointer>
+#include <QSize>
+#include <QString>
+#include <QVector3D>
+#include "Array2D.h"
+#include "Camera.h"
+
+class QFile;
+
+// Result of a camera pass: for every pixel the nearest visible position, its
+// depth from the camera and the index of the point it came from.  Written
+// to a raw file that is memory-mapped when loaded, so later runs can test
+// other sun positions without the points or the camera pass.
+//
+// Visibility file layout:
+//
+//   offset  size  contents
+//   0       8     magic "DSMVISIB"
+//   8       4     format version, currently 1
+//   12      4     width w
+//   16      4     height h
+//   20      4     reserved, 0
+//   24      12    scene minimum x, y, z as floats
+//   36      12    scene maximum x, y, z as floats
+//   48      20    SHA-1 scene hash as used for depth caching; zero if unknown
+//   68      4     voxel size the pass was rendered with as float; zero if
+//                 unknown
+//   72      12*n  position x, y, z of each of the n = w * h pixels as floats,
+//                 rows top to bottom; infinite for empty pixels
+//   ...     4*n   depth from the camera of each pixel as floats; infinite
+//                 for empty pixels
+//   ...     4*n   index of each pixel's point in the loaded cloud as signed
+//                 32-bit integers; -1 for empty pixels or unknown indices
+//
+// All values are in host byte order.
+class VisibilityBuffer
+{
+public:
+  VisibilityBuffer();
+
+  // Writes a camera pass.  indices is empty when point indices are unknown.
+  // Returns false on failure.
+  static bool save(const QString& path, const Array2D<QVector3D>& positions,
+                   const Array2D<int>& indices, const Camera& camera,
+                   const QVector3D& minimum, const QVector3D& maximum,
+                   const QByteArray& sceneHash, float voxelSize);
+
+  // Memory-maps a visibility file; returns null buffer on failure
+  static VisibilityBuffer load(const QString& path);
+
+  bool isNull() const { return m_positions == 0; }
+
+  int width()  const { return m_size.width();  }
+  int height() const { return m_size.height(); }
+  QSize size() const { return m_size; }
+
+  QVector3D position(int x, int y) const
+  {
+    const float *p = m_positions + 3 * (qint64(y) * m_size.width() + x);
+    return QVector3D(p[0], p[1], p[2]);
+  }
+
+  float depth(int x, int y) const
+  {
+    return m_depths[qint64(y) * m_size.width() + x];
+  }
+
+  int index(int x, int y) const
+  {
+    return m_indices[qint64(y) * m_size.width() + x];
+  }
+
+  // Copies positions into an array as filled by the camera pass
+  Array2D<QVector3D> positions() const;
+
+  QVector3D minimum() const { return m_minimum; }
+  QVector3D maximum() const { return m_maximum; }
+
+  // Empty if the scene hash was not known when saving
+  QByteArray sceneHash() const { return m_sceneHash; }
+
+  // Zero if the voxel size was not known when saving
+  float voxelSize() const { return m_voxelSize; }
+
+private:
+  QSize m_size;
+  const float *m_positions;
+  const float *m_depths;
+  const qint32 *m_indices;
+
+  QVector3D m_minimum;
+  QVector3D m_maximum;
+  QByteArray m_sceneHash;
+  float m_voxelSize;
+
+  // Mapped file; closed when the last copy is destroyed
+  QSharedPointer<QFile> m_file;
+};
+
+#endif // VISIBILITYBUFFER_H
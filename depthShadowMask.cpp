@@ -1,25 +1,57 @@
 #include <QCoreApplication>
 #include <QDebug>
 #include <QDir>
+#include <QFile>
+#include <QFileInfo>
 #include <QImage>
+#include <QImageReader>
 #include <QRgb>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QTextStream>
 #include <QTime>
 #include <QTimer>
 #include <QVector>
 #include <QVector3D>
+#include <QtMath>
 
 #include "Array2D.h"
+#include "BitMask.h"
+#include "BitMaskWriter.h"
+#include "BlockQueue.h"
+#include "DepthMapCache.h"
+#include "DepthWriter.h"
+#include "LASData.h"
+#include "MarginMap.h"
+#include "OccupancyGrid.h"
 #include "OptionParser.h"
+#include "OutputQueue.h"
+#include "ParallelFor.h"
 #include "PLYData.h"
+#include "PLYHeader.h"
+#include "PointCloud.h"
+#include "Ray.h"
 #include "StreamUtilities.h"
+#include "SunPosition.h"
+#include "VisibilityBuffer.h"
 #include "VoxelPixelArea.h"
 
 #include "TextProgress.h"
 
 #include "Camera.h"
 
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+
 #define qLocalized( S ) qPrintable(QLocale::system().toString(S))
 
+// Near and far planes of the orthographic sun projection.  Sun depth values
+// are normalized over this range.
+const double sunNearPlane = 0.001;
+const double sunFarPlane = 1000.0;
+
 
 QVector3D convert(const QRgb &c)
 {
@@ -73,8 +105,13 @@ void renderDepth(const Camera& camera, const Cube&c, Array2D<double>& depth)
 
 }
 
+// Keeps the nearest voxel center per pixel.  If indices is given, the index
+// of the voxel's point is kept along with it.  origin is the image pixel of
+// result(0, 0) when rendering a tile of the image.
 void renderVoxelPosition(const Camera& camera, const Cube &c,
-                         Array2D<QVector3D>& result)
+                         Array2D<QVector3D>& result,
+                         Array2D<int>* indices = 0, int index = -1,
+                         const QPoint& origin = QPoint())
 {
   float area = VoxelPixelArea::area(camera, c.center(), c.halfExtent());
   if(area <= 0) return; // This shouldn't happen!
@@ -82,7 +119,7 @@ void renderVoxelPosition(const Camera& camera, const Cube &c,
   if(area <= 1.0)
   {
     // Map to 2D array through camera
-    QPoint position = camera.imageCoordinate(c.center()).toPoint();
+    QPoint position = camera.imageCoordinate(c.center()).toPoint() - origin;
     // Validate position is in bounds
     if(result.contains(position.x(), position.y()))
     {
@@ -94,6 +131,7 @@ void renderVoxelPosition(const Camera& camera, const Cube &c,
       {
         // If closer than what's in buffer, replace
         result(position.x(), position.y()) = c.center();
+        if(indices) (*indices)(position.x(), position.y()) = index;
       }
     }
     return;
@@ -103,12 +141,13 @@ void renderVoxelPosition(const Camera& camera, const Cube &c,
     // Voxel is larger than a single pixel, subdivide
     for(int i = 0; i < 8; ++i)
     {
-      QVector3D origin = c.center();
-      origin[0] += c.halfExtent() * (i & 4 ? 0.5f : -0.5f);
-      origin[1] += c.halfExtent() * (i & 2 ? 0.5f : -0.5f);
-      origin[2] += c.halfExtent() * (i & 1 ? 0.5f : -0.5f);
+      QVector3D center = c.center();
+      center[0] += c.halfExtent() * (i & 4 ? 0.5f : -0.5f);
+      center[1] += c.halfExtent() * (i & 2 ? 0.5f : -0.5f);
+      center[2] += c.halfExtent() * (i & 1 ? 0.5f : -0.5f);
 
-      renderVoxelPosition(camera, Cube(origin, c.halfExtent() * 0.5), result);
+      renderVoxelPosition(camera, Cube(center, c.halfExtent() * 0.5), result,
+                          indices, index, origin);
     }
   }
 }
@@ -148,9 +187,13 @@ void renderDepth(const Camera& camera, const Cube&c, const QVector3D center,
   }
 
 }
-void renderVoxel(const Camera& camera, const Cube& c, const KRtCamera& krt,
-                 const QImage& img, Array2D<double> &depth,
-                 Array2D<Pixel>& result)
+// Colors the nearest voxel per pixel from the image of a projection
+// camera.  Voxels the projection camera sees within tolerance of depth, its
+// depth buffer, take the color of colors, its image as 32-bit pixels of the
+// same size; voxels hidden from it are red.
+void renderVoxel(const Camera& camera, const Cube& c, const Camera& projection,
+                 const QRgb *colors, const Array2D<double> &depth,
+                 float tolerance, Array2D<Pixel>& result)
 {
   float area = VoxelPixelArea::area(camera, c.center(), c.halfExtent());
 
@@ -168,26 +211,21 @@ void renderVoxel(const Camera& camera, const Cube& c, const KRtCamera& krt,
       {
         p.distance = distance;
 
-        // Get voxel in krt image
-        QPoint p2 = krt.imageCoordinate(c.center()).toPoint();
+        // Get voxel in projected image
+        QPoint p2 = projection.imageCoordinate(c.center()).toPoint();
 
         if(depth.contains(p2.x(), p2.y()))
         {
-          double d = (c.center() - krt.position()).length();
+          double d = projection.depth(c.center());
           // Check for occlusion from projection camera
-//          if(d <= depth(p2.x(), p2.y()))
-          if(qAbs(d - depth(p2.x(), p2.y())) < 1)
+          if(qAbs(d - depth(p2.x(), p2.y())) < tolerance)
           {
-            // Get color from image; default to 128 if not in bounds
-            QRgb color = qRgb(128, 128, 128);
-            if(img.rect().contains(p2)) color = img.pixel(p2);
-            p.color = color;
+            // Image and depth buffer are the same size, so the pixel is
+            // sampled without further checks
+            p.color = colors[p2.y() * depth.width() + p2.x()];
           }
           else
           {
-//            qDebug() << "Buffer depth/real depth:" << depth(p2.x(), p2.y())
-//                     << d;
-//            p.color = qRgb(64, 64, 64);
             p.color = qRgb(255, 0, 0);
           }
         }
@@ -204,160 +242,649 @@ void renderVoxel(const Camera& camera, const Cube& c, const KRtCamera& krt,
     origin[1] += c.halfExtent() * (i & 2 ? 0.5f : -0.5f);
     origin[2] += c.halfExtent() * (i & 1 ? 0.5f : -0.5f);
 
-    renderVoxel(camera, Cube(origin, c.halfExtent() * 0.5), krt, img, depth,
-                result);
+    renderVoxel(camera, Cube(origin, c.halfExtent() * 0.5), projection, colors,
+                depth, tolerance, result);
+  }
+
+}
+
+QRgb invert(QRgb color)
+{
+  return qRgb(255 - qRed(color), 255 - qGreen(color), 255 - qBlue(color));
+}
+
+QStringList getFilePaths(const QString& directory)
+{
+  QStringList paths;
+
+  QDir dir(directory);
+  for(const auto &entry: dir.entryInfoList(QDir::Files, QDir::Name))
+  {
+    paths << entry.absoluteFilePath();
   }
 
+  return paths;
 }
 
-double normalize(double min, double value, double max)
+// Inserts a zero-padded index before the suffix of path, e.g. mask.png
+// becomes mask-000012.png
+QString numberedPath(const QString& path, int index)
 {
-  if(max == min) return 0.0;
+  QFileInfo info(path);
+  QString name = info.completeBaseName()
+      + QStringLiteral("-%1").arg(index, 6, 10, QLatin1Char('0'));
+  if(!info.suffix().isEmpty()) name += "." + info.suffix();
 
-  return (value - min)/(max - min);
+  return QDir(info.path()).filePath(name);
 }
 
-QRgb invert(QRgb color)
+// Path of a saved camera pass; named after the KRt file in batch mode
+QString visibilityPath(const QString& path, const QString& cameraPath,
+                       bool cameraBatch)
 {
-  return qRgb(255 - qRed(color), 255 - qGreen(color), 255 - qBlue(color));
+  if(!cameraBatch) return path;
+
+  return QDir(path).filePath(QFileInfo(cameraPath).completeBaseName()
+                             + ".vis");
 }
 
-QRgb gray(double min, double value, double max)
+// Writes the world file of a north-up raster next to it, with a suffix of
+// the first and last letters of the raster's suffix and "w", e.g. mask.tfw
+// for mask.tif.  topLeft is the map position of the center of the top left
+// pixel.  Returns false on failure.
+bool saveWorldFile(const QString& path, const QPointF& topLeft,
+                   double pixelSize)
 {
-  int gray = 255.0 * normalize(min, value, max);
-  return qRgb(gray, gray, gray);
+  QFileInfo info(path);
+  QString suffix = info.suffix();
+  QString worldPath = QDir(info.path()).filePath(
+        info.completeBaseName() + "." + suffix.left(1) + suffix.right(1)
+        + "w");
+
+  // Pixel size in x, two rotation terms, negative pixel size in y, then the
+  // position of the top left pixel
+  QByteArray data;
+  data += QByteArray::number(pixelSize, 'g', 17) + "\n0\n0\n";
+  data += QByteArray::number(-pixelSize, 'g', 17) + "\n";
+  data += QByteArray::number(topLeft.x(), 'g', 17) + "\n";
+  data += QByteArray::number(topLeft.y(), 'g', 17) + "\n";
+
+  QSaveFile file(worldPath);
+  if(!file.open(QIODevice::WriteOnly)) return false;
+
+  file.write(data);
+  return file.commit();
 }
 
-QRgb gray(double v)
+// Top-down orthographic camera of rows [top, top + rows) of a ground grid.
+// Cell (0, 0) is centered on the north west corner of the scene bounds;
+// columns run east and rows south.  Depth is the drop below the top of the
+// scene.
+Camera groundCamera(const QVector3D& min, const QVector3D& max,
+                    double cellSize, int columns, int top, int rows)
 {
-  return qRgb(v * 255, v * 255, v * 255);
+  QMatrix4x4 view(1.0 / cellSize, 0, 0, -min.x() / cellSize,
+                  0, -1.0 / cellSize, 0, max.y() / cellSize - top,
+                  0, 0, -1, max.z(),
+                  0, 0, 0, 1);
+
+  // Looking straight down, voxels show only their tops
+  QVector3D position((min.x() + max.x()) / 2, (min.y() + max.y()) / 2,
+                     max.z() + 1);
+  return Camera(view, position, QSize(columns, rows));
 }
 
-QRgb jet(double v)
+// Orthographic light view of the sun.  The light is placed north looking
+// south, then rotated for elevation and azimuth.
+QMatrix4x4 sunView(const SunPosition& sun, float north)
 {
-  return qRgb(qBound(0.0, 1.5 - qAbs(4 * v - 3), 1.0) * 255,
-              qBound(0.0, 1.5 - qAbs(4 * v - 2), 1.0) * 255,
-              qBound(0.0, 1.5 - qAbs(4 * v - 1), 1.0) * 255);
+  QMatrix4x4 lightView;
+
+  // Place light from the north looking south
+  lightView.lookAt(QVector3D(0, north, 0), {0, 0, 0}, {0, 0, 1});
+
+  // Rotate for elevation
+  lightView.rotate(-sun.elevation(), {1, 0, 0});
+  // Rotate for azimuth
+  lightView.rotate(sun.azimuth(), {0, 0, 1});
+
+  return lightView;
 }
 
-QRgb hotcold(double v)
+// Renders the depth maps of all sun cameras in a single sweep over the
+// points.  Points are taken in blocks small enough to stay in cache while
+// every sun camera splats them; the cameras render each block in parallel.
+// Depth maps are initialized unless depths already holds one per sun, so
+// the blocks of a streamed cloud can be rendered by successive calls.
+void renderSunDepths(const QList<Camera>& suns, const PointCloud& cloud,
+                     float voxelSize, QVector< Array2D<double> >& depths,
+                     bool showProgress = true)
 {
-  return qRgb(qBound(0.0, 2 - qAbs(4 * v - 4), 1.0) * 255,
-              qBound(0.0, 2 - qAbs(4 * v - 2), 1.0) * 255,
-              qBound(0.0, 2 - qAbs(4 * v - 0), 1.0) * 255);
+  // Chunks per block; about 64k points for full chunks
+  const int blockSize = 16;
+
+  // Initialize arrays for depth values to infinity
+  if(depths.count() != suns.count())
+  {
+    depths.resize(suns.count());
+    for(int s = 0; s < suns.count(); ++s)
+    {
+      depths[s] = Array2D<double>(suns.at(s).imagePlaneSize());
+      depths[s].fill(qInf());
+    }
+  }
+
+  // Take pointer before threads start so the vector is not detached by them
+  Array2D<double> *targets = depths.data();
+
+  const QVector<PointCloud::Chunk>& chunks = cloud.chunks();
+  QScopedPointer<TextProgress> progress;
+  if(showProgress) progress.reset(new TextProgress(cloud.count(), 100));
+
+  for(int begin = 0; begin < chunks.count(); begin += blockSize)
+  {
+    int end = qMin(begin + blockSize, chunks.count());
+
+    parallelFor(suns.count(), 1, [&](int first, int last)
+    {
+      for(int s = first; s < last; ++s)
+      {
+        // For each voxel in block
+        for(int c = begin; c < end; ++c)
+        {
+          cloud.forEach(chunks.at(c), [&](int, const QVector3D& point)
+          {
+            Cube cube(point, voxelSize/2.0);
+            renderDepth(suns.at(s), cube, cube.center(), targets[s]);
+          });
+        }
+      }
+    });
+
+    if(progress)
+    {
+      progress->update(chunks.at(end - 1).begin + chunks.at(end - 1).count
+                       - 1);
+    }
+  }
 }
 
+// Reads the vertices of a binary PLY file in blocks and calls f with each
+// block, so a pass over a cloud larger than memory holds one block at a
+// time.  Returns false if a block fails to load.
 template<typename F>
-QRgb map(double min, double value, double max, F f)
+bool streamPoints(const QString& path, qint64 count, F f)
 {
-  return f(normalize(min, value, max));
+  const int blockSize = 1 << 22;
+
+  for(qint64 first = 0; first < count; first += blockSize)
+  {
+    PLYData ply;
+    ply.setRequestedProperties(QStringList() << "x" << "y" << "z");
+    ply.setVertexRange(first, int(qMin(qint64(blockSize), count - first)));
+    if(!ply.load(path)) return false;
+
+    f(PointCloud::fromPLY(ply));
+  }
+
+  return true;
 }
 
-QStringList getFilePaths(const QString& directory)
+// Indicates whether vertices of a PLY file can be read in blocks
+bool hasFixedVertexRecords(const PLYHeader& header)
 {
-  QStringList paths;
+  int element = header.elementIndex("vertex");
+  return header.storageMode() != PLY_ASCII && element >= 0
+      && header.recordSize(element) > 0 && header.elementOffset(element) >= 0;
+}
 
-  QDir dir(directory);
-  for(const auto &entry: dir.entryInfoList(QDir::Files, QDir::Name))
+// Reads scene bounds from a "bounds minx miny minz maxx maxy maxz" comment
+// of a PLY header.  Returns false if there is no such comment.
+bool readBounds(const QStringList& comments, QVector3D* min, QVector3D* max)
+{
+  for(const QString& comment: comments)
   {
-    paths << entry.absoluteFilePath();
+    QStringList words = comment.simplified().split(' ');
+    if(words.count() != 7 || words.first() != "bounds") continue;
+
+    bool ok = true;
+    float values[6];
+    for(int i = 0; i < 6 && ok; ++i) values[i] = words.at(i + 1).toFloat(&ok);
+    if(!ok) continue;
+
+    *min = QVector3D(values[0], values[1], values[2]);
+    *max = QVector3D(values[3], values[4], values[5]);
+    return true;
   }
 
-  return paths;
+  return false;
 }
 
-void saveDepth(const Array2D<double>& depth, const QString& path)
+// Reads the bounds of a point file without loading its points; from the LAS
+// header, or from a bounds comment of the PLY header
+bool readFileBounds(const QString& path, QVector3D* min, QVector3D* max)
 {
-  double min = qInf();
-  double max = -qInf();
+  if(LASData::isLASFile(path)) return LASData::readBounds(path, min, max);
+
+  PLYHeader header;
+  return header.read(path) && readBounds(header.comments(), min, max);
+}
 
-  QImage image(depth.size(), QImage::Format_BGR888);
+// Expands directories among paths into the PLY and LAS files they contain
+QStringList getPointPaths(const QStringList& paths)
+{
+  QStringList pointPaths;
 
-  for(int i = 1; i < depth.count(); ++i)
+  for(const QString& path: paths)
   {
-    // Skip empty values
-    if(depth.at(i) == qInf()) continue;
+    if(!QFileInfo(path).isDir())
+    {
+      pointPaths << path;
+      continue;
+    }
 
-    if(depth.at(i) < min) min = depth.at(i);
-    if(depth.at(i) > max) max = depth.at(i);
+    QDir dir(path);
+    for(const auto &entry: dir.entryInfoList(QStringList() << "*.ply"
+                                             << "*.ply.gz" << "*.ply.zst"
+                                             << "*.las", QDir::Files,
+                                             QDir::Name))
+    {
+      pointPaths << entry.absoluteFilePath();
+    }
   }
 
-  qDebug() << "Depth min/max:" << min << max;
+  return pointPaths;
+}
+
+// Loads positions from a PLY or LAS file.  Positions are floats, so LAS
+// files with coordinates too far from the origin to resolve a tenth of a
+// voxel of resolution are warned about.  Returns false on failure.
+bool loadPoints(const QString& path, LASData::ReturnFilter returnFilter,
+                float resolution, PointCloud* cloud)
+{
+  if(LASData::isLASFile(path))
+  {
+    LASData las;
+    las.setReturnFilter(returnFilter);
+    if(!las.load(path))
+    {
+      qWarning() << "Failed loading LAS file" << path << las.errorString();
+      return false;
+    }
 
-  for(int y = 0; y < depth.height(); ++y)
-    for(int x = 0; x < depth.width(); ++x)
+    // Spacing of floats at the largest coordinate, such as a UTM northing
+    float largest = 0;
+    for(int j = 0; j < 3; ++j)
+    {
+      largest = qMax(largest, qMax(std::fabs(las.minimum()[j]),
+                                   std::fabs(las.maximum()[j])));
+    }
+    const float spacing = std::nextafter(
+          largest, std::numeric_limits<float>::infinity()) - largest;
+    if(las.vertexCount() > 0 && spacing > resolution / 10)
     {
-      image.setPixel(x, y, gray(min, depth(x,y), max));
+      qWarning() << "Coordinates of" << path << "reach" << largest
+                 << "and are only resolved to" << spacing
+                 << "as floats, too coarse for resolution" << resolution;
     }
 
-  image.save(path);
+    *cloud = PointCloud::fromLAS(las);
+    return true;
+  }
+
+  PLYData ply;
+  // Only positions are used
+  ply.setRequestedProperties(QStringList() << "x" << "y" << "z");
+  if(!ply.load(path))
+  {
+    qWarning() << "Failed loading PLY file" << path << ply.errorString();
+    return false;
+  }
+
+  *cloud = PointCloud::fromPLY(ply);
+  return true;
 }
 
-QImage renderImage(const Camera& camera, const QString& krtPath,
-                   const QString& imagePath, const PLYData& ply,
-                   float resolution = 1.0)
+// Image bounds, from first to last, of a box grown by margin on each side
+// as projected by a camera.  Returns false without setting them if the box
+// reaches behind the camera, where it may project anywhere.
+bool projectBox(const KRtCamera& krt, const Box& box, float margin,
+                QPointF *first, QPointF *last)
+{
+  QVector3D min = box.minimum() - QVector3D(margin, margin, margin);
+  QVector3D max = box.maximum() + QVector3D(margin, margin, margin);
+
+  // Image bounds of projected corners
+  QPointF low, high;
+  for(int i = 0; i < 8; ++i)
+  {
+    QVector3D corner(i & 1 ? max.x() : min.x(), i & 2 ? max.y() : min.y(),
+                     i & 4 ? max.z() : min.z());
+    if(QVector3D::dotProduct(corner - krt.position(), krt.direction()) <= 0)
+      return false;
+
+    QPointF point = krt.imageCoordinate(corner);
+    if(i == 0) low = high = point;
+    low = QPointF(qMin(low.x(), point.x()), qMin(low.y(), point.y()));
+    high = QPointF(qMax(high.x(), point.x()), qMax(high.y(), point.y()));
+  }
+
+  *first = low;
+  *last = high;
+  return true;
+}
+
+// Indicates whether any part of a box, grown by margin on each side, may
+// project into the image of a camera.  Conservative; boxes reaching behind
+// the camera are always visible.
+bool isBoxVisible(const KRtCamera& krt, const Box& box, float margin)
 {
-  // Get references to point position arrays
-  const QVector<float>& x = ply.vertexData("x");
-  const QVector<float>& y = ply.vertexData("y");
-  const QVector<float>& z = ply.vertexData("z");
+  QPointF first, last;
+  if(!projectBox(krt, box, margin, &first, &last)) return true;
 
-  // Load krt projection path
-  KRtCamera projection = KRtCamera::load(krtPath);
-//  projection = projection.scaled(0.25);
-  projection = projection.scaled(0.5);
+  QSize size = krt.imagePlaneSize();
+  return last.x() >= 0 && last.y() >= 0
+      && first.x() < size.width() && first.y() < size.height();
+}
+
+// Indicates whether anything inside box may be seen by a camera or may
+// shadow something it sees.  The shadow of the box is bounded by sweeping
+// it away from each sun down to floor height.
+bool mayAffectView(const KRtCamera& krt, const Box& box,
+                   const QVector<QVector3D>& sunDirections, float floor,
+                   float margin)
+{
+  if(isBoxVisible(krt, box, margin)) return true;
+
+  for(const QVector3D& toSun: sunDirections)
+  {
+    // Shadows of a sun on the horizon are unbounded
+    if(toSun.z() <= 0) return true;
+
+    QVector3D shift = -toSun * ((box.maximum().z() - floor) / toSun.z());
+    QVector3D min = box.minimum(), max = box.maximum();
+    for(int i = 0; i < 3; ++i)
+    {
+      min[i] = qMin(min[i], min[i] + shift[i]);
+      max[i] = qMax(max[i], max[i] + shift[i]);
+    }
+
+    if(isBoxVisible(krt, Box(min, max), margin)) return true;
+  }
+
+  return false;
+}
+
+// Reads a list of file paths, one per line.  Relative paths are relative to
+// the directory of the list file.
+QStringList readFilePaths(const QString& listPath)
+{
+  QStringList paths;
+
+  QFile file(listPath);
+  if(!file.open(QIODevice::ReadOnly | QIODevice::Text)) return paths;
 
+  QDir dir = QFileInfo(listPath).dir();
+  QTextStream stream(&file);
+  while(!stream.atEnd())
+  {
+    QString line = stream.readLine().trimmed();
+    if(!line.isEmpty()) paths << dir.filePath(line);
+  }
+
+  return paths;
+}
+
+// Generates a binary mask with pixels set where the visible position is
+// reported in shadow by inShadow().  Rows are tested in parallel.
+template<typename F>
+BitMask generateShadowMask(const Array2D<QVector3D>& positions, F inShadow)
+{
+  BitMask mask(positions.size());
+  const QVector3D empty(qInf(), qInf(), qInf());
 
-//  Camera projection(krt);
+  parallelFor(positions.height(), 1, [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+    {
+      // Rows are whole words, so threads never share one
+      quint64 *line = mask.scanLine(y);
+
+      for(int x = 0; x < positions.width(); ++x)
+      {
+        const QVector3D &position3d = positions(x, y);
+
+        // If position it empty, skip it
+        if(position3d == empty) continue;
+
+        if(inShadow(position3d)) line[x >> 6] |= quint64(1) << (x & 63);
+      }
+    }
+  });
 
-  // Load image to project
-  QImage image(imagePath);
-  image = image.scaled(projection.imagePlaneSize());
+  return mask;
+}
 
-  qDebug() << "Loaded" << imagePath << "with size" << image.size();
+// Decodes an image straight at size as rows of 32-bit pixels without
+// padding.  Decoders such as JPEG scale while decoding instead of after.
+// Returns a null image on failure.
+QImage loadProjectedImage(const QString& path, const QSize& size)
+{
+  QImageReader reader(path);
+  reader.setScaledSize(size);
+  QImage image = reader.read();
+  if(image.size() != size) return QImage();
 
-  qDebug() << "Generating projected depth map";
+  return image.convertToFormat(QImage::Format_RGB32);
+}
 
-  // Create depth buffer
+// Depth buffer of the points as seen by the camera of a projected image
+Array2D<double> renderProjectionDepth(const KRtCamera& krt,
+                                      const QVector<PointCloud>& blocks,
+                                      float resolution)
+{
+  Camera projection(krt);
   Array2D<double> depth(projection.imagePlaneSize());
   depth.fill(qInf());
 
-  TextProgress depthProgress(ply.vertexCount(), 100);
-  for(int v = 0, count = ply.vertexCount(); v < count; v++)
+  for(const PointCloud& block: blocks)
   {
-    Cube c(QVector3D(x.at(v), y.at(v), z.at(v)), resolution/2.0);
-    renderDepth(projection, c, c.center(), depth);
-    depthProgress.update(v);
+    for(const PointCloud::Chunk& chunk: block.chunks())
+    {
+      if(!isBoxVisible(krt, chunk.bounds, resolution/2.0)) continue;
+
+      block.forEach(chunk, [&](int, const QVector3D& point)
+      {
+        Cube c(point, resolution/2.0);
+        renderDepth(projection, c, c.center(), depth);
+      });
+    }
   }
 
-  saveDepth(depth, "depth.png");
+  return depth;
+}
+
+// Projects an image onto the points as seen by view.  krt is the camera of
+// the image, which is decoded straight at its size.  Points within a voxel
+// of the depth krt sees take their color from the image; points it cannot
+// see are red.  Returns a null image if the image fails to load.
+QImage renderImage(const KRtCamera& view, const KRtCamera& krt,
+                   const QString& imagePath, const QVector<PointCloud>& blocks,
+                   float resolution = 1.0)
+{
+  QImage image = loadProjectedImage(imagePath, krt.imagePlaneSize());
+  if(image.isNull()) return QImage();
+  const QRgb *colors = reinterpret_cast<const QRgb*>(image.constBits());
 
-  qDebug() << "done.";
+  Camera camera(view);
+  Camera projection(krt);
+  Array2D<double> depth = renderProjectionDepth(krt, blocks, resolution);
 
   // Pixel buffer
   Array2D<Pixel> pixels(camera.imagePlaneSize());
 
-  TextProgress progress(ply.vertexCount(), 100);
-
-  for(int v = 0, count = ply.vertexCount(); v < count; v++)
+  for(const PointCloud& block: blocks)
   {
-    Cube c(QVector3D(x.at(v), y.at(v), z.at(v)), resolution/2.0);
-    renderVoxel(camera, c, projection, image, depth, pixels);
+    for(const PointCloud::Chunk& chunk: block.chunks())
+    {
+      if(!isBoxVisible(view, chunk.bounds, resolution/2.0)) continue;
 
-    progress.update(v);
+      block.forEach(chunk, [&](int, const QVector3D& point)
+      {
+        Cube c(point, resolution/2.0);
+        renderVoxel(camera, c, projection, colors, depth, resolution, pixels);
+      });
+    }
   }
 
   // Convert pixel buffer to image
-  QImage result(pixels.size(), QImage::Format_BGR888);
+  QImage result(pixels.size(), QImage::Format_RGB32);
   for(int y = 0; y < result.height(); ++y)
-    for(int x = 0; x < result.width(); ++x)
+  {
+    QRgb *line = reinterpret_cast<QRgb*>(result.scanLine(y));
+    for(int x = 0; x < result.width(); ++x) line[x] = pixels(x, y).color;
+  }
+
+  return result;
+}
+
+// Colors each point from the projected image that sees it best, given as
+// pairs of image and KRt camera paths.  Without normals, views are scored
+// by cos(angle) / distance^2, the angle being between the ray to the point
+// and the camera's optical axis, so near views seeing the point close to
+// their axis win.  Images are processed concurrently, each with its own
+// depth buffer.  Each point keeps its best score and color packed in one
+// 64-bit word that is raised by compare-and-swap, so no locks are taken.
+// Points no image sees are black.
+QVector<QRgb> colorizePoints(
+    const QVector< QPair<QString, QString> >& textures,
+    const QVector<PointCloud>& blocks, float textureScale, float resolution)
+{
+  // Points of later blocks follow on from earlier ones
+  QVector<int> blockStarts;
+  int count = 0;
+  for(const PointCloud& block: blocks)
+  {
+    blockStarts.push_back(count);
+    count += block.count();
+  }
+
+  // Score bits above color bits.  Positive floats order like their bits,
+  // so comparing words compares scores; zero marks points not yet seen.
+  QVector< QAtomicInteger<quint64> > best(count);
+  // Take pointer before threads start so the vector is not detached
+  QAtomicInteger<quint64> *bestColors = best.data();
+
+  QtConcurrent::blockingMap(textures,
+                            [&](const QPair<QString, QString>& texture)
+  {
+    KRtCamera krt = KRtCamera::load(texture.second);
+    if(krt.isNull())
+    {
+      qWarning() << "Failed loading camera" << texture.second;
+      return;
+    }
+    krt = krt.scaled(textureScale);
+
+    QImage image = loadProjectedImage(texture.first, krt.imagePlaneSize());
+    if(image.isNull())
+    {
+      qWarning() << "Failed loading image" << texture.first;
+      return;
+    }
+    const QRgb *colors = reinterpret_cast<const QRgb*>(image.constBits());
+
+    Camera projection(krt);
+    Array2D<double> depth = renderProjectionDepth(krt, blocks, resolution);
+    const QVector3D eye = krt.position();
+    const QVector3D axis = krt.direction().normalized();
+
+    for(int b = 0; b < blocks.count(); ++b)
     {
-      result.setPixel(x, y, pixels(x, y).color);
+      const PointCloud &block = blocks.at(b);
+      for(const PointCloud::Chunk& chunk: block.chunks())
+      {
+        if(!isBoxVisible(krt, chunk.bounds, resolution/2.0)) continue;
+
+        block.forEach(chunk, [&](int i, const QVector3D& point)
+        {
+          QPoint p = projection.imageCoordinate(point).toPoint();
+          if(!depth.contains(p.x(), p.y())) return;
+
+          // Check for occlusion from projection camera
+          if(qAbs(projection.depth(point) - depth(p.x(), p.y())) >= resolution)
+            return;
+
+          // cos(angle) / distance^2 is the ray's projection on the axis
+          // over the cubed distance
+          const QVector3D ray = point - eye;
+          const float distance = ray.length();
+          const float weight = QVector3D::dotProduct(ray, axis)
+              / (distance * distance * distance);
+          if(!(weight > 0)) return;
+
+          quint32 score;
+          std::memcpy(&score, &weight, sizeof(score));
+          const quint64 candidate = (quint64(score) << 32)
+              | (colors[p.y() * depth.width() + p.x()] & 0xffffff);
+
+          QAtomicInteger<quint64> &word = bestColors[blockStarts.at(b) + i];
+          quint64 current = word.loadAcquire();
+          while(candidate > current
+                && !word.testAndSetOrdered(current, candidate, current))
+          {
+          }
+        });
+      }
     }
 
+    qDebug() << "Projected" << texture.first;
+  });
+
+  QVector<QRgb> result(count);
+  for(int i = 0; i < count; ++i)
+    result[i] = qRgb(0, 0, 0) | quint32(bestColors[i].loadAcquire());
+
   return result;
 }
 
+// Writes points with 8-bit colors, in the order of the blocks, as a binary
+// PLY file.  Returns false on failure.
+bool saveColoredPLY(const QString& path, const QVector<PointCloud>& blocks,
+                    const QVector<QRgb>& colors)
+{
+  p_ply ply = ply_create(qPrintable(path), PLY_LITTLE_ENDIAN, 0, 0, 0);
+  if(!ply) return false;
+
+  bool ok = ply_add_element(ply, "vertex", colors.count())
+      && ply_add_scalar_property(ply, "x", PLY_FLOAT)
+      && ply_add_scalar_property(ply, "y", PLY_FLOAT)
+      && ply_add_scalar_property(ply, "z", PLY_FLOAT)
+      && ply_add_scalar_property(ply, "red", PLY_UCHAR)
+      && ply_add_scalar_property(ply, "green", PLY_UCHAR)
+      && ply_add_scalar_property(ply, "blue", PLY_UCHAR)
+      && ply_write_header(ply);
+
+  // Points of later blocks follow on from earlier ones
+  int blockStart = 0;
+  for(const PointCloud& block: blocks)
+  {
+    for(const PointCloud::Chunk& chunk: block.chunks())
+    {
+      block.forEach(chunk, [&](int i, const QVector3D& point)
+      {
+        QRgb color = colors.at(blockStart + i);
+        ok = ok && ply_write(ply, point.x()) && ply_write(ply, point.y())
+            && ply_write(ply, point.z()) && ply_write(ply, qRed(color))
+            && ply_write(ply, qGreen(color)) && ply_write(ply, qBlue(color));
+      });
+    }
+    blockStart += block.count();
+  }
+
+  return ply_close(ply) && ok;
+}
+
 int main(int argc, char *argv[])
 {
   char programName[] = "depthShadowMask";
@@ -382,41 +909,190 @@ int main(int argc, char *argv[])
                     depthDimension);
   options.addOption('e', "elevation", "Sun elevation", "degrees", elevation);
   options.addOption('o', "output", "Output mask image", "file");
-  options.addOption('p', "ply", "PLY file", "file");
+  options.addOption('p', "ply", "PLY, gzip or zstd compressed PLY, or LAS "
+                    "file, or directory of tiles; repeat for several tiles",
+                    "file");
   options.addOption('r', "resolution", "Voxel size", "size", voxelSize);
   options.addOption('s', "scale", "Output image scale", "scale", 1.0);
-  options.addOption("depthmap", "Output path for depthmap (optional)", "file");
-
-//  options.addOption('k', "krt", "Directory containing KRt files", "path");
-//  options.addOption('i', "images", "Directory containing images.", "path");
+  options.addOption("depthmap", "Output path for depthmap (optional); .pfm "
+                    "and .tif keep float depths, other images are scaled",
+                    "file");
+  options.addOption("depthcolormap", "Colors of scaled depthmap images: gray "
+                    "(16-bit), jet or hotcold", "name");
+  options.addOption("rle", "Compress TIFF masks with PackBits run-length "
+                    "encoding");
+  options.addOption("tilesize", "Render cameras in square tiles of this many "
+                    "pixels, rounded up to a multiple of 64, writing PBM, PNG "
+                    "or TIFF masks a row of tiles at a time", "pixels");
+  options.addOption("pointcache", "Binary point cache; written from the PLY "
+                    "file if missing, used instead of it otherwise", "file");
+  options.addOption("quantize", "Store points as 16-bit offsets in units of "
+                    "scale; applies when the point cache is written",
+                    "scale");
+  options.addOption("stream", "Read the binary PLY file in blocks for every "
+                    "pass instead of loading it into memory");
+  options.addOption("cull", "Skip tiles that can neither be seen by the "
+                    "cameras nor shadow anything they see, judged from "
+                    "bounds in the tile headers");
+  options.addOption("returns", "LAS returns to load: all, first or last",
+                    "returns");
+  options.addOption("savevisibility", "Write the camera pass for reuse; a "
+                    "file per camera into this directory in batch mode",
+                    "path");
+  options.addOption("loadvisibility", "Use camera passes written by "
+                    "--savevisibility instead of rendering them; points are "
+                    "not loaded when all sun depth maps are cached", "path");
+  options.addOption("savemargins", "Write the shadow margin of every pixel "
+                    "as PFM for --biassweep; a file per camera into this "
+                    "directory in batch mode, numbered per sun", "path");
+  options.addOption("biassweep", "Threshold margins written by "
+                    "--savemargins at each of --biases instead of rendering; "
+                    "prints the shadow fraction per bias and writes numbered "
+                    "masks if --output is given", "file");
+  options.addOption("biases", "Comma-separated biases for --biassweep",
+                    "list");
+  options.addOption("cache", "Directory for reusing sun depth maps across "
+                    "runs (optional)", "path");
+  options.addOption("raymarch", "Ray march toward the sun through a voxel "
+                    "occupancy grid instead of using a sun depth map");
+  options.addOption("raycast", "Cast a ray per camera pixel through a voxel "
+                    "occupancy grid instead of rendering every voxel");
+  options.addOption("suns", "File of sun azimuth/elevation pairs, one per "
+                    "line; writes a numbered mask per sun", "file");
+  options.addOption("sunrange", "Sun positions over a time range; writes a "
+                    "numbered mask per position", "start,end,minutes");
+  options.addOption("location", "Latitude and longitude for --sunrange",
+                    "lat,lon");
+
+  options.addOption('k', "krt", "Directory or list file of KRt cameras; "
+                    "writes a mask per camera into the output directory",
+                    "path");
+  options.addOption('i', "images", "Directory of images to project onto the "
+                    "points as seen by --camera, paired in name order with "
+                    "their --krt cameras; writes a textured view per image "
+                    "into the output directory", "path");
+  options.addOption("texturescale", "Scale of projected images and their "
+                    "cameras", "scale", 1.0);
+  options.addOption("colorize", "With --images, color each point from the "
+                    "image that sees it best and write the colored points as "
+                    "the output PLY file instead of textured views");
+  options.addOption("ground", "Write shadow masks of a top-down grid of "
+                    "ground cells of this size instead of a camera view, with "
+                    "world files; TIFF masks are also GeoTIFF tagged", "size");
+  options.addOption("pointshadows", "Test every point against the suns and "
+                    "write the points as the output PLY file with a shadow "
+                    "property, or words of per-sun shadow bits for several "
+                    "suns, instead of masks");
 
   options.parse(a.arguments());
 
-  // Get PLY file
-  QString plypath;
-  options.getRequiredValue("ply", &plypath);
-  PLYData ply;
-  if(!ply.load(plypath))
+  // Masks for a list of biases follow from saved margins alone, without
+  // points, cameras or suns
+  QString sweepPath;
+  if(options.getOptionalValue("biassweep", &sweepPath))
   {
-    qCritical() << "Failed loading PLY file" << plypath;
-    exit(EXIT_FAILURE);
+    MarginMap margins = MarginMap::load(sweepPath);
+    if(margins.isNull())
+    {
+      qCritical() << "Failed loading margins" << sweepPath;
+      exit(EXIT_FAILURE);
+    }
+
+    QString biasList;
+    options.getRequiredValue("biases", &biasList);
+    QVector<float> biases;
+    for(const QString& value: biasList.split(','))
+    {
+      bool ok;
+      biases.push_back(value.toFloat(&ok));
+      if(!ok)
+      {
+        qWarning("Failed parsing option biases");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    // Curve of shadow fraction over bias, one line per bias
+    QVector<double> fractions = margins.shadowFractions(biases);
+    QTextStream out(stdout);
+    for(int i = 0; i < biases.count(); ++i)
+      out << biases.at(i) << " " << fractions.at(i) << "\n";
+    out.flush();
+
+    QString outputPath;
+    if(options.getOptionalValue("output", &outputPath))
+    {
+      OutputQueue outputs;
+      for(int i = 0; i < biases.count(); ++i)
+      {
+        outputs.save(margins.threshold(biases.at(i)),
+                     numberedPath(outputPath, i), options.isSet("rle"));
+      }
+      int failures = outputs.waitForFinished();
+      if(failures > 0)
+      {
+        qCritical() << "Failed saving" << failures << "outputs";
+        return EXIT_FAILURE;
+      }
+    }
+
+    return EXIT_SUCCESS;
+  }
+
+  // Get cameras; a single camera or a batch of KRt files
+  QStringList cameraPaths;
+  QString metaPath;
+  if(options.getOptionalValue("krt", &metaPath))
+  {
+    if(QFileInfo(metaPath).isDir())
+      cameraPaths = getFilePaths(metaPath);
+    else
+      cameraPaths = readFilePaths(metaPath);
+
+    qDebug() << "Found" << cameraPaths.count() << "metadata files.";
+    if(cameraPaths.isEmpty()) exit(EXIT_FAILURE);
+  }
+  else if(!options.isSet("pointshadows") && !options.isSet("ground"))
+  {
+    QString cameraPath;
+    options.getRequiredValue("camera", &cameraPath);
+    cameraPaths << cameraPath;
   }
 
-  // Get camera
-  QString cameraPath;
-  options.getRequiredValue("camera", &cameraPath);
-  KRtCamera krt = KRtCamera::load(cameraPath);
+  // Shadows of the points themselves or of a ground grid need no camera
+  bool pointShadows = options.isSet("pointshadows");
+  bool groundGrid = options.isSet("ground");
+
+  // Get optional images to project.  The KRt cameras are then the cameras
+  // of the images, and the single camera is the view they are rendered in.
+  QStringList imagePaths;
+  QStringList projectionPaths;
+  QString imagesPath;
+  if(options.getOptionalValue("images", &imagesPath))
+  {
+    imagePaths = getFilePaths(imagesPath);
+    qDebug() << "Found" << imagePaths.count() << "images.";
+    if(!options.isSet("krt") || imagePaths.count() != cameraPaths.count())
+    {
+      qCritical("Projected images need one KRt camera each (--krt)");
+      exit(EXIT_FAILURE);
+    }
 
-  // Get metadata directory
-//  QString metaPath;
-//  options.getRequiredValue("krt", &metaPath);
-//  QStringList metaFilenames = getFilePaths(metaPath);
-//  qDebug() << "Found" << metaFilenames.count() << "metadata files.";
+    // Colored points need no view
+    projectionPaths = cameraPaths;
+    cameraPaths.clear();
+    if(!options.isSet("colorize"))
+    {
+      QString cameraPath;
+      options.getRequiredValue("camera", &cameraPath);
+      cameraPaths << cameraPath;
+    }
+  }
+  bool colorize = !imagePaths.isEmpty() && options.isSet("colorize");
 
-  // Get images directory
-//  QString imagesPath;
-//  options.getRequiredValue("images", &imagesPath);
-//  QStringList imageFilenames = getFilePaths(imagesPath);
+  // Each camera writes a mask into the output directory in batch mode
+  bool cameraBatch = options.isSet("krt") && imagePaths.isEmpty()
+      && !pointShadows && !groundGrid;
 
   // Get optional voxel size
   options.getOptionalValue("resolution", &voxelSize);
@@ -424,13 +1100,23 @@ int main(int argc, char *argv[])
   // Get output path
   QString outputPath;
   options.getRequiredValue("output", &outputPath);
-  qDebug() << "Saving image as" << outputPath;
+  if(cameraBatch || (!imagePaths.isEmpty() && !colorize))
+  {
+    qDebug() << "Saving images in" << outputPath;
+    QDir().mkpath(outputPath);
+  }
+  else
+  {
+    qDebug() << "Saving image as" << outputPath;
+  }
 
   // Get optional camera scale
   float cameraScale = 1.0;
   options.getOptionalValue("scale", &cameraScale);
-  krt = krt.scaled(cameraScale);
-  Camera krtCamera(krt);
+
+  // Get optional scale of projected images
+  float textureScale = 1.0;
+  options.getOptionalValue("texturescale", &textureScale);
 
   // Get optional depthmap size
   options.getOptionalValue("dmapsize", &depthDimension);
@@ -438,29 +1124,603 @@ int main(int argc, char *argv[])
   // Get optional bias
   options.getOptionalValue("bias", &bias);
 
+  // Masks are written as 1-bit PBM, PNG or TIFF by suffix
+  bool packBits = options.isSet("rle");
+
+  // Get optional tile size.  Tiles are whole mask words wide, so tiles
+  // rendered in parallel never write to the same word.
+  int tileSize = 0;
+  options.getOptionalValue("tilesize", &tileSize);
+  if(tileSize < 0)
+  {
+    qWarning("Failed parsing option tilesize");
+    exit(EXIT_FAILURE);
+  }
+  tileSize = (tileSize + 63) / 64 * 64;
+  if(tileSize > 0 && !cameraBatch && !BitMaskWriter::isSupported(outputPath))
+  {
+    qCritical("Tiled masks must be written as PBM, PNG or TIFF");
+    exit(EXIT_FAILURE);
+  }
+
   // Get optional output for depthmap
   QString outputDepthMap;
   options.getOptionalValue("depthmap", &outputDepthMap);
 
+  // Get optional colormap for depthmap images
+  DepthWriter depthWriter;
+  QString colormap;
+  if(options.getOptionalValue("depthcolormap", &colormap))
+  {
+    DepthWriter::Colormap depthColormap;
+    if(!DepthWriter::parseColormap(colormap, &depthColormap))
+    {
+      qWarning("Failed parsing option depthcolormap");
+      exit(EXIT_FAILURE);
+    }
+    depthWriter.setColormap(depthColormap);
+  }
+
+  // Finished depth maps, camera passes and masks are encoded and written in
+  // the background while rendering continues
+  OutputQueue outputs;
+
+  // Get optional depth map cache
+  QString cachePath;
+  DepthMapCache depthCache;
+  if(options.getOptionalValue("cache", &cachePath))
+    depthCache = DepthMapCache(cachePath);
+
   // Get sun position
   options.getOptionalValue("azimuth", &azimuth);
   options.getOptionalValue("elevation", &elevation);
+  QVector<SunPosition> suns;
+  suns.push_back(SunPosition(azimuth, elevation));
 
+  // Get optional list of sun positions
+  QString sunsPath;
+  if(options.getOptionalValue("suns", &sunsPath))
+  {
+    suns = SunPosition::load(sunsPath);
+    if(suns.isEmpty())
+    {
+      qCritical() << "Failed loading sun positions" << sunsPath;
+      exit(EXIT_FAILURE);
+    }
+  }
 
-//  Camera camera = camera.scaled(cameraScale);
-//  qDebug() << "Image plane size:" << camera.imagePlaneSize();
-//  qDebug() << "Projecting 0,0,0 to image plane:" << camera.imageCoordinate({0, 0, 0});
-
-  QVector3D min(ply.minimum("x"), ply.minimum("y"), ply.minimum("z"));
-  QVector3D max(ply.maximum("x"), ply.maximum("y"), ply.maximum("z"));
-  qDebug() << "Minimum:" << min;
-  qDebug() << "Maximum:" << max;
+  // Get optional time range of sun positions
+  QString sunRange;
+  if(options.getOptionalValue("sunrange", &sunRange))
+  {
+    QString location;
+    options.getRequiredValue("location", &location);
+
+    QStringList range = sunRange.split(',');
+    QStringList latLon = location.split(',');
+    QDateTime start, end;
+    double minutes = 0, latitude = 0, longitude = 0;
+    bool ok = range.count() == 3 && latLon.count() == 2;
+    if(ok)
+    {
+      start = QDateTime::fromString(range.at(0), Qt::ISODate);
+      end = QDateTime::fromString(range.at(1), Qt::ISODate);
+      minutes = range.at(2).toDouble(&ok);
+    }
+    if(ok) latitude = latLon.at(0).toDouble(&ok);
+    if(ok) longitude = latLon.at(1).toDouble(&ok);
 
-//  qDebug() << "Projecting min coord" << camera.imageCoordinate(min);
-//  qDebug() << "Projecting max coord" << camera.imageCoordinate(max);
+    // Steps that round to no seconds would never advance
+    qint64 step = 0;
+    if(ok && minutes > 0
+       && minutes < std::numeric_limits<qint64>::max() / 60.0)
+    {
+      step = qRound64(minutes * 60);
+    }
+    if(!ok || !start.isValid() || !end.isValid() || step <= 0)
+    {
+      qWarning("Failed parsing option sunrange");
+      exit(EXIT_FAILURE);
+    }
 
-  qDebug() << "PLY file contains" << qLocalized(ply.vertexCount())
-           << "vertices.";
+    // Only positions above the horizon can cast shadows
+    suns.clear();
+    for(QDateTime t = start; t <= end; t = t.addSecs(step))
+    {
+      SunPosition sun = SunPosition::at(t, latitude, longitude);
+      if(sun.isAboveHorizon()) suns.push_back(sun);
+    }
+
+    if(suns.isEmpty())
+    {
+      qCritical() << "Sun is below the horizon for the entire range";
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Each sun position writes a numbered mask in batch mode
+  bool sunBatch = options.isSet("suns") || options.isSet("sunrange");
+  if(sunBatch)
+    qDebug() << "Rendering" << suns.count() << "sun positions.";
+
+  // Get shadow mode
+  bool rayMarch = false;
+  options.getOptionalValue("raymarch", &rayMarch);
+
+  // Get camera visibility mode
+  bool rayCast = false;
+  options.getOptionalValue("raycast", &rayCast);
+
+  // Get optional saved camera passes
+  QString saveVisibilityPath;
+  QString loadVisibilityPath;
+  options.getOptionalValue("savevisibility", &saveVisibilityPath);
+  options.getOptionalValue("loadvisibility", &loadVisibilityPath);
+  if(cameraBatch && !saveVisibilityPath.isEmpty())
+    QDir().mkpath(saveVisibilityPath);
+  if(tileSize > 0 && !saveVisibilityPath.isEmpty())
+    qWarning("Camera passes are not saved when rendering tiles");
+
+  // Get optional ground cell size
+  double groundCellSize = 0.0;
+  options.getOptionalValue("ground", &groundCellSize);
+  if(groundGrid && groundCellSize <= 0)
+  {
+    qWarning("Failed parsing option ground");
+    exit(EXIT_FAILURE);
+  }
+  if(groundGrid && !BitMaskWriter::isSupported(outputPath))
+  {
+    qCritical("Ground masks must be written as PBM, PNG or TIFF");
+    exit(EXIT_FAILURE);
+  }
+
+  // Get optional output of shadow margins
+  QString saveMarginsPath;
+  options.getOptionalValue("savemargins", &saveMarginsPath);
+  if(!saveMarginsPath.isEmpty() && rayMarch)
+  {
+    qCritical("Margins need sun depth maps and cannot be ray marched");
+    exit(EXIT_FAILURE);
+  }
+  if(cameraBatch && !saveMarginsPath.isEmpty())
+    QDir().mkpath(saveMarginsPath);
+  if(tileSize > 0 && !saveMarginsPath.isEmpty())
+    qWarning("Margins are not saved when rendering tiles");
+
+  // A saved camera pass records the scene bounds and hash, so the points are
+  // not needed when every sun depth map is cached
+  VisibilityBuffer savedScene;
+  bool skipPoints = false;
+  if(!loadVisibilityPath.isEmpty() && !cameraPaths.isEmpty() && !rayMarch
+     && !depthCache.isNull())
+  {
+    savedScene = VisibilityBuffer::load(
+          visibilityPath(loadVisibilityPath, cameraPaths.first(), cameraBatch));
+    skipPoints = !savedScene.isNull() && !savedScene.sceneHash().isEmpty();
+    for(int s = 0; skipPoints && s < suns.count(); ++s)
+    {
+      skipPoints = depthCache.contains(
+            DepthMapCache::key(savedScene.sceneHash(), suns.at(s),
+                               qRound(depthDimension), voxelSize));
+    }
+  }
+
+  // Get points from point cache, or from PLY file
+  QString pointCachePath;
+  options.getOptionalValue("pointcache", &pointCachePath);
+  double quantizeScale = 0.0;
+  options.getOptionalValue("quantize", &quantizeScale);
+  bool streaming = false;
+  options.getOptionalValue("stream", &streaming);
+  if(streaming && tileSize > 0)
+  {
+    qCritical("Tiled rendering bins the points in memory and cannot stream");
+    exit(EXIT_FAILURE);
+  }
+  if(streaming && !imagePaths.isEmpty())
+  {
+    qCritical("Images are projected concurrently and cannot stream points");
+    exit(EXIT_FAILURE);
+  }
+
+  LASData::ReturnFilter returnFilter = LASData::AllReturns;
+  QString returns;
+  if(options.getOptionalValue("returns", &returns))
+  {
+    if(returns == "first") returnFilter = LASData::FirstReturns;
+    else if(returns == "last") returnFilter = LASData::LastReturns;
+    else if(returns != "all")
+    {
+      qWarning("Failed parsing option returns");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Loading options hashed with the scene files, so depth maps of points
+  // loaded differently are never shared
+  QStringList loadOptions;
+  if(returnFilter != LASData::AllReturns) loadOptions << "returns=" + returns;
+
+  PointCloud cloud;
+  // Files the points were read from; identify the scene for depth caching
+  QStringList scenePaths;
+  // Hash of the files and loadOptions; computed when first needed, since
+  // it reads every file
+  QByteArray sceneHash;
+
+  // Scene bounds; known before loading if given by the PLY header
+  QVector3D min, max;
+  bool haveBounds = false;
+  qint64 pointCount = 0;
+
+  // Binary PLY file read in blocks.  When streaming, every pass reads it
+  // again; otherwise a background reader loads it once, overlapping the
+  // first pass, and the blocks are kept.
+  QString blockPath;
+
+  // Points in memory; the whole cloud or the blocks loaded from blockPath
+  QVector<PointCloud> blocks;
+
+  if(!skipPoints && !pointCachePath.isEmpty()
+     && QFileInfo::exists(pointCachePath))
+  {
+    cloud = PointCloud::load(pointCachePath);
+    if(cloud.isNull())
+      qWarning() << "Ignoring invalid point cache" << pointCachePath;
+    else
+      scenePaths << pointCachePath;
+
+    // Identity of the files the cache was written from, so depth maps are
+    // shared with runs loading them directly
+    sceneHash = cloud.sourceHash();
+  }
+
+  if(cloud.isNull() && !skipPoints)
+  {
+    if(!options.isSet("ply"))
+    {
+      qWarning("Missing required option ply");
+      exit(EXIT_FAILURE);
+    }
+
+    // Tiles are given by repeating --ply or as a directory
+    QStringList pointPaths = getPointPaths(options.values("ply"));
+    if(pointPaths.isEmpty())
+    {
+      qCritical() << "No PLY or LAS files in" << options.values("ply");
+      exit(EXIT_FAILURE);
+    }
+
+    // A point cache and quantization need the whole cloud in memory
+    bool wholeCloud = !pointCachePath.isEmpty() || quantizeScale > 0.0;
+
+    if(pointPaths.count() > 1)
+    {
+      if(streaming)
+      {
+        qWarning("Streaming takes a single PLY file; loading tiles whole");
+        streaming = false;
+      }
+
+      // Every point matters when testing points or the ground, so none are
+      // culled
+      if(options.isSet("cull") && !pointShadows && !groundGrid)
+      {
+        // Culling needs the bounds of every tile; the lowest one bounds
+        // the reach of shadows
+        QVector<Box> tileBounds;
+        float floor = qInf();
+        for(const QString& path: pointPaths)
+        {
+          QVector3D tileMin, tileMax;
+          if(!readFileBounds(path, &tileMin, &tileMax)) break;
+          tileBounds.push_back(Box(tileMin, tileMax));
+          floor = qMin(floor, tileMin.z());
+        }
+
+        if(tileBounds.count() != pointPaths.count())
+        {
+          qWarning("Not culling tiles; some headers have no bounds");
+        }
+        else
+        {
+          // Projected images need no suns, but whatever their cameras see
+          // may hide points from them
+          QVector<QVector3D> sunDirections;
+          for(const SunPosition& sun: suns)
+          {
+            if(!imagePaths.isEmpty()) break;
+            sunDirections.push_back(sunView(sun, 0).inverted()
+                .mapVector(QVector3D(0, 0, 1)).normalized());
+          }
+
+          QList<KRtCamera> cameras;
+          for(const QString& cameraPath: cameraPaths + projectionPaths)
+          {
+            KRtCamera krt = KRtCamera::load(cameraPath);
+            if(!krt.isNull()) cameras.push_back(krt.scaled(cameraScale));
+          }
+
+          QStringList kept;
+          for(int t = 0; t < pointPaths.count(); ++t)
+          {
+            for(const KRtCamera& krt: cameras)
+            {
+              if(mayAffectView(krt, tileBounds.at(t), sunDirections, floor,
+                               voxelSize/2.0))
+              {
+                kept << pointPaths.at(t);
+                break;
+              }
+            }
+          }
+
+          qDebug() << "Culled" << pointPaths.count() - kept.count() << "of"
+                   << pointPaths.count() << "tiles.";
+          pointPaths = kept;
+        }
+      }
+
+      qDebug() << "Loading" << pointPaths.count() << "tiles...";
+
+      // One tile per pool thread; the parsers are parallel within a tile
+      QVector<PointCloud> tiles(pointPaths.count());
+      QVector<int> loaded(pointPaths.count(), 0);
+      PointCloud *tileBits = tiles.data();
+      int *loadedBits = loaded.data();
+      parallelFor(pointPaths.count(), 1, [&](int begin, int end)
+      {
+        for(int t = begin; t < end; ++t)
+          loadedBits[t] = loadPoints(pointPaths.at(t), returnFilter,
+                                     voxelSize, &tileBits[t]);
+      });
+
+      if(loaded.contains(0)) exit(EXIT_FAILURE);
+
+      cloud = PointCloud::merge(tiles);
+      scenePaths = pointPaths;
+    }
+    else
+    {
+      QString plypath = pointPaths.first();
+      scenePaths << plypath;
+
+      // LAS files are always loaded whole
+      bool las = LASData::isLASFile(plypath);
+
+      PLYHeader header;
+      bool fixedRecords = !las && header.read(plypath)
+          && hasFixedVertexRecords(header);
+      if(fixedRecords)
+      {
+        haveBounds = readBounds(header.comments(), &min, &max);
+        pointCount = header.elements().at(header.elementIndex("vertex")).count;
+      }
+
+      if(streaming)
+      {
+        if(!fixedRecords)
+        {
+          qCritical() << "Streaming requires an uncompressed binary PLY "
+                         "file with fixed-size vertex records" << plypath;
+          exit(EXIT_FAILURE);
+        }
+
+        if(wholeCloud)
+          qWarning("Point cache and quantization are not used when streaming");
+
+        blockPath = plypath;
+      }
+      else if(fixedRecords && haveBounds && !wholeCloud)
+      {
+        blockPath = plypath;
+      }
+      else if(!loadPoints(plypath, returnFilter, voxelSize, &cloud))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if(cloud.isNull() && blockPath.isEmpty())
+    {
+      qCritical() << "No points loaded from" << pointPaths;
+      exit(EXIT_FAILURE);
+    }
+
+    if(!cloud.isNull())
+    {
+      // Spatial order keeps chunk bounds tight for culling and chunk extents
+      // small for quantizing
+      if(wholeCloud) cloud.sortSpatially();
+
+      if(quantizeScale > 0.0 && !cloud.quantize(quantizeScale))
+      {
+        qCritical() << "Invalid quantization scale" << quantizeScale;
+        exit(EXIT_FAILURE);
+      }
+      // Quantizing moves points by up to half a step
+      if(cloud.isQuantized())
+        loadOptions << "quantize=" + QString::number(quantizeScale, 'g', 17);
+
+      if(!pointCachePath.isEmpty())
+      {
+        sceneHash = DepthMapCache::hashScene(
+              DepthMapCache::hashFiles(scenePaths), loadOptions);
+        cloud.setSourceHash(sceneHash);
+        if(!cloud.save(pointCachePath))
+          qWarning() << "Failed writing point cache" << pointCachePath;
+      }
+    }
+  }
+
+  if(!cloud.isNull())
+  {
+    blocks.push_back(cloud);
+    min = cloud.minimum();
+    max = cloud.maximum();
+    haveBounds = true;
+    pointCount = cloud.count();
+  }
+
+  if(skipPoints)
+  {
+    qDebug() << "Using the scene of the saved camera pass; points are not "
+                "loaded.";
+    min = savedScene.minimum();
+    max = savedScene.maximum();
+    haveBounds = true;
+  }
+
+  // Calls f with each block of points
+  auto forEachBlock = [&](const std::function<void(const PointCloud&)>& f)
+  {
+    bool ok = true;
+
+    if(streaming)
+    {
+      ok = streamPoints(blockPath, pointCount, f);
+    }
+    else if(!blockPath.isEmpty())
+    {
+      // Blocks are handed over as they load, so time to result approaches
+      // the longer of loading and the first pass instead of their sum
+      BlockQueue<PointCloud> queue(4);
+      QFuture<bool> reader = QtConcurrent::run([&]()
+      {
+        bool read = streamPoints(blockPath, pointCount,
+                                 [&](const PointCloud& block)
+        {
+          queue.push(block);
+        });
+
+        // Null cloud marks the end
+        queue.push(PointCloud());
+        return read;
+      });
+
+      for(PointCloud block = queue.pop(); !block.isNull(); block = queue.pop())
+      {
+        f(block);
+        blocks.push_back(block);
+      }
+
+      ok = reader.result();
+      blockPath.clear();
+    }
+    else
+    {
+      for(const PointCloud& block: blocks) f(block);
+    }
+
+    if(!ok)
+    {
+      qCritical() << "Failed reading PLY file" << scenePaths.first();
+      exit(EXIT_FAILURE);
+    }
+  };
+
+
+//  Camera camera = camera.scaled(cameraScale);
+//  qDebug() << "Image plane size:" << camera.imagePlaneSize();
+//  qDebug() << "Projecting 0,0,0 to image plane:" << camera.imageCoordinate({0, 0, 0});
+
+  if(!haveBounds)
+  {
+    qDebug() << "Reading bounds...";
+
+    // Bounds are needed before any pass, so the file is read once for them
+    bool first = true;
+    forEachBlock([&](const PointCloud& block)
+    {
+      for(int i = 0; i < 3; ++i)
+      {
+        min[i] = first ? block.minimum()[i] : qMin(min[i], block.minimum()[i]);
+        max[i] = first ? block.maximum()[i] : qMax(max[i], block.maximum()[i]);
+      }
+      first = false;
+    });
+  }
+
+  qDebug() << "Minimum:" << min;
+  qDebug() << "Maximum:" << max;
+
+//  qDebug() << "Projecting min coord" << camera.imageCoordinate(min);
+//  qDebug() << "Projecting max coord" << camera.imageCoordinate(max);
+
+  qDebug() << "Point cloud contains" << qLocalized(pointCount)
+           << "vertices.";
+
+  // Projected images are rendered instead of shadow masks
+  if(!imagePaths.isEmpty())
+  {
+    // Concurrent images share the loaded blocks, so a background load must
+    // finish first
+    if(!blockPath.isEmpty()) forEachBlock([](const PointCloud&) { });
+
+    QVector< QPair<QString, QString> > textures;
+    for(int i = 0; i < imagePaths.count(); ++i)
+      textures.push_back(qMakePair(imagePaths.at(i), projectionPaths.at(i)));
+
+    if(colorize)
+    {
+      qDebug() << "Coloring points from" << textures.count() << "images...";
+      QVector<QRgb> colors = colorizePoints(textures, blocks, textureScale,
+                                            voxelSize);
+
+      qDebug() << "Saving" << outputPath;
+      if(!saveColoredPLY(outputPath, blocks, colors))
+      {
+        qCritical() << "Failed saving colored points" << outputPath;
+        exit(EXIT_FAILURE);
+      }
+    }
+    else
+    {
+      KRtCamera view = KRtCamera::load(cameraPaths.first());
+      if(view.isNull())
+      {
+        qCritical() << "Failed loading camera" << cameraPaths.first();
+        exit(EXIT_FAILURE);
+      }
+      view = view.scaled(cameraScale);
+
+      // Images render concurrently, each with its own depth and pixel buffers
+      QtConcurrent::blockingMap(textures,
+                                [&](const QPair<QString, QString>& texture)
+      {
+        KRtCamera krt = KRtCamera::load(texture.second);
+        if(krt.isNull())
+        {
+          qWarning() << "Failed loading camera" << texture.second;
+          return;
+        }
+
+        QImage image = renderImage(view, krt.scaled(textureScale),
+                                   texture.first, blocks, voxelSize);
+        if(image.isNull())
+        {
+          qWarning() << "Failed loading image" << texture.first;
+          return;
+        }
+
+        QString path = QDir(outputPath).filePath(
+              QFileInfo(texture.first).completeBaseName() + ".jpg");
+        qDebug() << "Saving" << path;
+        outputs.save(image, path);
+      });
+    }
+
+    int failures = outputs.waitForFinished();
+    if(failures > 0)
+    {
+      qCritical() << "Failed saving" << failures << "outputs";
+      return EXIT_FAILURE;
+    }
+
+    qDebug() << "done";
+    return EXIT_SUCCESS;
+  }
 
 //  QVector3D center = min + (max - min)/2.0;
 
@@ -470,82 +1730,198 @@ int main(int argc, char *argv[])
   projection.viewport(QRectF(QPointF(0, 0), shadowDepthSize));
 //  projection.ortho(-500, 500, 500, -500, 0.001, 10000.0);
 //  projection.ortho(min.x(), max.x(), max.y(), min.y(), min.z(), max.z());
-  projection.ortho(min.x(), max.x(), max.y(), min.y(), 0.001, 1000.0);
+  projection.ortho(min.x(), max.x(), max.y(), min.y(), sunNearPlane,
+                   sunFarPlane);
 
-  QMatrix4x4 lightView;
+  // Light view and camera for each sun position
+  QList<QMatrix4x4> lightViews;
+  QList<Camera> sunCameras;
+  for(const SunPosition& sun: suns)
+  {
+    QMatrix4x4 lightView = sunView(sun, max.y());
+    lightViews.push_back(lightView);
+    sunCameras.push_back(Camera(projection * lightView,
+                                QVector3D(0, 0, max.z()),
+                                shadowDepthSize.toSize()));
+  }
 
-  // Place light from the north looking south
-  lightView.lookAt(QVector3D(0, ply.maximum("y"), 0), {0, 0, 0}, {0, 0, 1});
-  qDebug() << "South looking rotation:" << lightView;
+  // Depth of voxels from each sun
+  QVector< Array2D<double> > depthArrays;
 
-  // Rotate for elevation
-  lightView.rotate(-elevation, {1, 0, 0});
-  // Rotate for azimuth
-  lightView.rotate(azimuth, {0, 0, 1});
+  // Occupancy of voxels for ray marching
+  OccupancyGrid occupancy;
 
-  Camera sunCamera(projection * lightView, QVector3D(0, 0, max.z()),
-                   shadowDepthSize.toSize());
+  // Sun positions without a cached depth map
+  QVector<int> missing;
+  QVector<QByteArray> keys;
 
-  // Initialize array for depth values to infinity
-  Array2D<double> depthArray(sunCamera.imagePlaneSize());
-  depthArray.fill(qInf());
+  if(rayMarch)
+  {
+    if(!outputDepthMap.isEmpty())
+      qWarning("No depthmap is rendered when ray marching shadows");
+  }
+  else
+  {
+    depthArrays.resize(suns.count());
 
-  // Get references to point position arrays
-  const QVector<float>& x = ply.vertexData("x");
-  const QVector<float>& y = ply.vertexData("y");
-  const QVector<float>& z = ply.vertexData("z");
+    if(depthCache.isNull())
+    {
+      for(int s = 0; s < suns.count(); ++s) missing.push_back(s);
+    }
+    else
+    {
+      if(skipPoints)
+      {
+        sceneHash = savedScene.sceneHash();
+      }
+      else if(sceneHash.isEmpty())
+      {
+        sceneHash = DepthMapCache::hashScene(
+              DepthMapCache::hashFiles(scenePaths), loadOptions);
+      }
+      for(int s = 0; s < suns.count(); ++s)
+      {
+        keys.push_back(DepthMapCache::key(sceneHash, suns.at(s),
+                                          shadowDepthSize.toSize().width(),
+                                          voxelSize));
+        if(!depthCache.load(keys.at(s), &depthArrays[s])) missing.push_back(s);
+      }
 
-  TextProgress depthProgress(ply.vertexCount(), 100);
+      qDebug() << "Loaded" << suns.count() - missing.count()
+               << "cached depth maps.";
+    }
+  }
 
-  // For each voxel in point cloud
-  for(int v = 0, count = ply.vertexCount(); v < count; ++v)
+  // Camera passes record the scene hash, so loading them can check it
+  if(sceneHash.isEmpty() && !skipPoints
+     && (!saveVisibilityPath.isEmpty() || !loadVisibilityPath.isEmpty()))
   {
-    Cube c(QVector3D(x.at(v), y.at(v), z.at(v)), voxelSize/2.0);
-    renderDepth(sunCamera, c, c.center(), depthArray);
-    depthProgress.update(v);
+    sceneHash = DepthMapCache::hashScene(DepthMapCache::hashFiles(scenePaths),
+                                         loadOptions);
   }
 
-  // Optionally save depth map image
-  if(!outputDepthMap.isEmpty()) saveDepth(depthArray, outputDepthMap);
+  // Saved camera passes must come from this scene and resolution; scenes
+  // loaded in another way may differ by a fraction of a voxel in bounds
+  if(!loadVisibilityPath.isEmpty())
+  {
+    for(const QString& cameraPath: cameraPaths)
+    {
+      QString path = visibilityPath(loadVisibilityPath, cameraPath,
+                                    cameraBatch);
+      VisibilityBuffer visibility = VisibilityBuffer::load(path);
+      if(visibility.isNull()) continue;
 
-  // For each voxel, determine visibility from
-  Array2D<double> krtDepthArray(krtCamera.imagePlaneSize());
-  krtDepthArray.fill(qInf());
+      bool sameBounds = true;
+      for(int i = 0; i < 3; ++i)
+      {
+        sameBounds = sameBounds
+            && qAbs(visibility.minimum()[i] - min[i]) <= voxelSize/2.0
+            && qAbs(visibility.maximum()[i] - max[i]) <= voxelSize/2.0;
+      }
 
-  Array2D<QVector3D> positionArray(krtCamera.imagePlaneSize());
-  positionArray.fill(QVector3D(qInf(), qInf(), qInf()));
+      bool sameHash = visibility.sceneHash().isEmpty()
+          || visibility.sceneHash() == sceneHash;
 
-  qDebug() << "Rendering voxel positions...";
+      bool sameVoxels = visibility.voxelSize() == 0.0f
+          || visibility.voxelSize() == float(voxelSize);
 
-  TextProgress positionProgress(ply.vertexCount(), 100);
+      if(!sameBounds || !sameHash || !sameVoxels)
+      {
+        qCritical() << "Camera pass" << path << "was saved for another scene "
+                       "or resolution";
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
 
-  // For each voxel in point cloud
-  for(int v = 0, count = ply.vertexCount(); v < count; ++v)
-  {
-    Cube c(QVector3D(x.at(v), y.at(v), z.at(v)), voxelSize/2.0);
+  QList<Camera> missingCameras;
+  for(int s: missing) missingCameras.push_back(sunCameras.at(s));
 
-    // Save 3D position of visible voxel
-    renderVoxelPosition(krtCamera, c, positionArray);
-    positionProgress.update(v);
+  // Saved camera passes replace casting rays
+  bool buildOccupancy = rayMarch || (rayCast && loadVisibilityPath.isEmpty());
+  if(buildOccupancy)
+  {
+    qDebug() << "Building occupancy grid...";
+    occupancy = OccupancyGrid(min, max, voxelSize);
   }
 
-  qDebug() << "done.";
+  // Progress is only shown for a pass over the whole cloud at once
+  bool showProgress = blocks.count() == 1 && !streaming;
+
+  // The occupancy grid and all missing sun depth maps are built in one pass
+  // over the points, which consumes blocks while they load
+  QVector< Array2D<double> > rendered;
+  if(buildOccupancy || !missing.isEmpty())
+  {
+    forEachBlock([&](const PointCloud& block)
+    {
+      if(buildOccupancy)
+      {
+        for(const PointCloud::Chunk& chunk: block.chunks())
+        {
+          block.forEach(chunk, [&](int, const QVector3D& point)
+          {
+            occupancy.insert(point);
+          });
+        }
+      }
+
+      if(!missingCameras.isEmpty())
+      {
+        renderSunDepths(missingCameras, block, voxelSize, rendered,
+                        showProgress);
+      }
+    });
+  }
 
-  // Should probably write out image representing contents of position array
-  // for evaluation.
+  if(buildOccupancy)
+  {
+    qDebug() << "Occupancy grid uses" << qLocalized(occupancy.brickCount())
+             << "bricks.";
+  }
 
-  QImage shadowMask(krtCamera.imagePlaneSize(), QImage::Format_RGB32);
-  shadowMask.fill(Qt::black);
+  for(int i = 0; i < missing.count(); ++i)
+  {
+    depthArrays[missing.at(i)] = rendered.at(i);
 
-  qDebug() << "Generating shadow mask...";
+    if(!depthCache.isNull()
+       && !depthCache.save(keys.at(missing.at(i)), rendered.at(i)))
+    {
+      qWarning() << "Failed caching depth map in" << cachePath;
+    }
+  }
 
-  // For each pixel
-  for(int i = 0; i < positionArray.count(); ++i)
+  if(!rayMarch)
   {
-    QVector3D position3d = positionArray.at(i);
+    // Optionally save depth map images
+    if(!outputDepthMap.isEmpty())
+    {
+      for(int s = 0; s < depthArrays.count(); ++s)
+      {
+        QString depthPath = sunBatch ? numberedPath(outputDepthMap, s)
+                                     : outputDepthMap;
+        outputs.save(depthArrays.at(s), depthPath, depthWriter);
+      }
+    }
+  }
+
+  // Direction toward each sun for ray marching; +z in light view coordinates
+  QVector<QVector3D> toSun;
+  for(const QMatrix4x4& lightView: lightViews)
+    toSun.push_back(lightView.inverted().mapVector(QVector3D(0, 0, 1))
+                    .normalized());
 
-    // If position it empty, skip it
-    if(position3d == QVector3D(qInf(), qInf(), qInf())) continue;
+  // Bias is in normalized sun depth; convert to distance along the ray and
+  // always step out of the voxel the ray starts in
+  const double rayStart = qMax(bias * (sunFarPlane - sunNearPlane),
+                               voxelSize * qSqrt(3.0));
+
+  // Depth of a position from sun s beyond the depth in the sun depth map;
+  // -infinity outside the depth map
+  auto shadowMargin = [&](int s, const QVector3D& position3d) -> float
+  {
+    const Camera &sunCamera = sunCameras.at(s);
+    const Array2D<double> &depthArray = depthArrays.at(s);
 
     // Get depth through light matrix
     float lightDistance = sunCamera.depth(position3d);
@@ -553,39 +1929,614 @@ int main(int argc, char *argv[])
     // Get image plane position in shadow map
     QPoint lightPlanePosition = sunCamera.imageCoordinate(position3d).toPoint();
 
-    if(depthArray.contains(lightPlanePosition.x(), lightPlanePosition.y()))
+    if(!depthArray.contains(lightPlanePosition.x(), lightPlanePosition.y()))
+      return -qInf();
+
+    float bufferDepth = depthArray(lightPlanePosition.x(),
+                                   lightPlanePosition.y());
+
+    return lightDistance - bufferDepth;
+  };
+
+  // Indicates whether a position seen by a camera is in shadow from sun s
+  auto inShadow = [&](int s, const QVector3D& position3d) -> bool
+  {
+    if(rayMarch)
     {
-      float bufferDepth = depthArray(lightPlanePosition.x(),
-                                     lightPlanePosition.y());
+      // 3D position is in shadow if anything lies between it and the sun
+      return occupancy.intersect(Ray(position3d, toSun.at(s)), rayStart,
+                                 qInf());
+    }
+
+    // 3D position is in shadow if something is nearer the sun by more than
+    // the bias; the same rule --biassweep applies to saved margins
+    return shadowMargin(s, position3d) > bias;
+  };
 
-      if(bufferDepth < (lightDistance - bias))
+  // Points are tested directly instead of through a camera.  Blocks are
+  // tested and written as they arrive, so a streamed cloud is read once.
+  if(pointShadows)
+  {
+    qDebug() << "Testing points for shadow...";
+
+    // A single sun writes 0 or 1; several suns write bit s % 32 of word
+    // s / 32
+    const int sunCount = suns.count();
+    const int words = (sunCount + 31) / 32;
+
+    p_ply ply = ply_create(qPrintable(outputPath), PLY_LITTLE_ENDIAN, 0, 0, 0);
+    bool ok = ply && ply_add_element(ply, "vertex", long(pointCount))
+        && ply_add_scalar_property(ply, "x", PLY_FLOAT)
+        && ply_add_scalar_property(ply, "y", PLY_FLOAT)
+        && ply_add_scalar_property(ply, "z", PLY_FLOAT);
+    if(sunCount == 1)
+    {
+      ok = ok && ply_add_scalar_property(ply, "shadow", PLY_UCHAR);
+    }
+    else
+    {
+      for(int w = 0; w < words; ++w)
       {
-        // 3D position is in shadow
-        QPoint krtPosition = krtCamera.imageCoordinate(position3d).toPoint();
-        shadowMask.setPixel(krtPosition, qRgb(255,255,255));
+        QByteArray name("shadow");
+        if(words > 1) name += QByteArray::number(w);
+        ok = ok && ply_add_scalar_property(ply, name.constData(), PLY_UINT);
       }
     }
+    ok = ok && ply_write_header(ply);
+
+    forEachBlock([&](const PointCloud& block)
+    {
+      if(!ok) return;
+
+      // Chunks are tested in parallel into shadow words per point
+      QVector<quint32> shadows(block.count() * words, 0);
+      quint32 *bits = shadows.data();
+      const QVector<PointCloud::Chunk> &chunks = block.chunks();
+      parallelFor(chunks.count(), parallelBlockSize(chunks.count()),
+                  [&](int begin, int end)
+      {
+        for(int c = begin; c < end; ++c)
+        {
+          block.forEach(chunks.at(c), [&](int i, const QVector3D& point)
+          {
+            quint32 *pointBits = bits + qint64(i) * words;
+            for(int s = 0; s < sunCount; ++s)
+              if(inShadow(s, point)) pointBits[s >> 5] |= 1u << (s & 31);
+          });
+        }
+      });
+
+      for(const PointCloud::Chunk& chunk: chunks)
+      {
+        block.forEach(chunk, [&](int i, const QVector3D& point)
+        {
+          ok = ok && ply_write(ply, point.x()) && ply_write(ply, point.y())
+              && ply_write(ply, point.z());
+          for(int w = 0; w < words; ++w)
+            ok = ok && ply_write(ply, bits[qint64(i) * words + w]);
+        });
+      }
+    });
+
+    if(!ply || !ply_close(ply) || !ok)
+    {
+      qCritical() << "Failed saving points" << outputPath;
+      exit(EXIT_FAILURE);
+    }
+
+    int failures = outputs.waitForFinished();
+    if(failures > 0)
+    {
+      qCritical() << "Failed saving" << failures << "outputs";
+      return EXIT_FAILURE;
+    }
+
+    qDebug() << "done";
+    return EXIT_SUCCESS;
   }
 
-  shadowMask.save(outputPath);
+  // Masks of a camera batch are named after the KRt file, and masks of a sun
+  // batch are numbered
+  auto maskPath = [&](const QString& cameraPath, int s)
+  {
+    QString path = outputPath;
+    if(cameraBatch)
+    {
+      path = QDir(outputPath).filePath(
+            QFileInfo(cameraPath).completeBaseName() + ".png");
+    }
+    if(sunBatch) path = numberedPath(path, s);
+    return path;
+  };
+
+  // Shadows on a top-down grid of ground cells instead of a camera view.
+  // Each cell keeps the top of the points above it, then is tested against
+  // every sun.  The grid is split into strips of rows, each rendered and
+  // tested by one thread with its own camera.
+  if(groundGrid)
+  {
+    const double columnCount = std::floor((max.x() - min.x()) / groundCellSize)
+        + 1;
+    const double rowCount = std::floor((max.y() - min.y()) / groundCellSize)
+        + 1;
+    if(columnCount * rowCount > std::numeric_limits<int>::max())
+    {
+      qCritical("Ground grid is too large for its cell size");
+      exit(EXIT_FAILURE);
+    }
+    const int columns = int(columnCount);
+    const int rows = int(rowCount);
 
-  qDebug() << "done";
+    // Map position of the center of the top left cell
+    const QPointF topLeft(min.x(), max.y());
+
+    qDebug() << "Rendering ground grid of" << columns << "by" << rows
+             << "cells...";
+
+    const int stripRows = parallelBlockSize(rows, 16);
+    QList<Camera> stripCameras;
+    QVector< Array2D<double> > stripDepths;
+    for(int top = 0; top < rows; top += stripRows)
+    {
+      int count = qMin(stripRows, rows - top);
+      stripCameras.push_back(groundCamera(min, max, groundCellSize, columns,
+                                          top, count));
+      Array2D<double> depth(columns, count);
+      depth.fill(qInf());
+      stripDepths.push_back(depth);
+    }
+
+    // Take pointer before threads start so the vector is not detached
+    Array2D<double> *depths = stripDepths.data();
+
+    forEachBlock([&](const PointCloud& block)
+    {
+      parallelFor(stripCameras.count(), 1, [&](int first, int last)
+      {
+        for(int t = first; t < last; ++t)
+        {
+          // Map y range of the strip's cells, grown by a voxel
+          const int top = t * stripRows;
+          const double north = max.y() - (top - 0.5) * groundCellSize
+              + voxelSize;
+          const double south = max.y()
+              - (top + depths[t].height() - 0.5) * groundCellSize - voxelSize;
+
+          for(const PointCloud::Chunk& chunk: block.chunks())
+          {
+            if(chunk.bounds.maximum().y() < south
+               || chunk.bounds.minimum().y() > north)
+            {
+              continue;
+            }
+
+            block.forEach(chunk, [&](int, const QVector3D& point)
+            {
+              Cube c(point, voxelSize/2.0);
+              renderDepth(stripCameras.at(t), c, c.center(), depths[t]);
+            });
+          }
+        }
+      });
+    });
+
+    QVector<BitMask> groundMasks;
+    for(int s = 0; s < suns.count(); ++s)
+      groundMasks.push_back(BitMask(columns, rows));
+    // Strips are whole rows, so threads never share a mask word
+    BitMask *masks = groundMasks.data();
+
+    parallelFor(stripCameras.count(), 1, [&](int first, int last)
+    {
+      for(int t = first; t < last; ++t)
+      {
+        const int top = t * stripRows;
+        const Array2D<double> &depth = depths[t];
+        for(int y = 0; y < depth.height(); ++y)
+        {
+          for(int x = 0; x < columns; ++x)
+          {
+            // Cells without points are left lit
+            double d = depth(x, y);
+            if(d == qInf()) continue;
+
+            QVector3D position(topLeft.x() + x * groundCellSize,
+                               topLeft.y() - (top + y) * groundCellSize,
+                               max.z() - d);
+            for(int s = 0; s < suns.count(); ++s)
+              if(inShadow(s, position)) masks[s].setBit(x, top + y);
+          }
+        }
+      }
+    });
 
-//  for(int i = 0; i < metaFilenames.count(); ++i)
-//  {
+    const double cellSize = groundCellSize;
+    for(int s = 0; s < suns.count(); ++s)
+    {
+      QString path = sunBatch ? numberedPath(outputPath, s) : outputPath;
+      if(sunBatch) qDebug() << "Saving" << path;
 
-//    QImage image = renderImage(camera, metaFilenames.at(i),
-//                               imageFilenames.at(i), ply, voxelSize);
+      BitMask mask = groundMasks.at(s);
+      outputs.write(path, [mask, path, topLeft, cellSize, packBits]()
+      {
+        // GeoTIFF ties the corner of the top left cell, not its center
+        BitMaskWriter writer;
+        writer.setGeoreference(QPointF(topLeft.x() - cellSize / 2,
+                                       topLeft.y() + cellSize / 2), cellSize);
+        return writer.open(path, mask.size(), packBits) && writer.write(mask)
+            && writer.close() && saveWorldFile(path, topLeft, cellSize);
+      });
+    }
 
-//    QString filename = outputPath +
-//        QStringLiteral("-%1.jpg").arg(i, 6, 10, QLatin1Char('0'));
+    int failures = outputs.waitForFinished();
+    if(failures > 0)
+    {
+      qCritical() << "Failed saving" << failures << "outputs";
+      return EXIT_FAILURE;
+    }
 
-//    qDebug() << "Saving" << filename;
+    qDebug() << "done";
+    return EXIT_SUCCESS;
+  }
 
-//    image.save(filename);
+  // Margins of a camera batch are named after the KRt file, and margins of a
+  // sun batch are numbered
+  auto marginPath = [&](const QString& cameraPath, int s)
+  {
+    QString path = saveMarginsPath;
+    if(cameraBatch)
+    {
+      path = QDir(saveMarginsPath).filePath(
+            QFileInfo(cameraPath).completeBaseName() + ".pfm");
+    }
+    if(sunBatch) path = numberedPath(path, s);
+    return path;
+  };
+
+  // Renders a camera a row of tiles at a time and appends each row to the
+  // masks, so memory is bounded by the tile size instead of the image size.
+  // Chunks are binned by the tiles they may project into, then the tiles of
+  // a row render in parallel, each into its own positions.
+  auto renderCameraTiles = [&](const KRtCamera& krt, const QString& cameraPath)
+  {
+    Camera krtCamera(krt);
+    const QSize imageSize = krtCamera.imagePlaneSize();
+    const int columns = (imageSize.width() + tileSize - 1) / tileSize;
+    const int rows = (imageSize.height() + tileSize - 1) / tileSize;
+
+    VisibilityBuffer visibility;
+    if(!loadVisibilityPath.isEmpty())
+    {
+      QString path = visibilityPath(loadVisibilityPath, cameraPath,
+                                    cameraBatch);
+      visibility = VisibilityBuffer::load(path);
+      if(visibility.isNull() || visibility.size() != imageSize)
+      {
+        qWarning() << "Failed loading camera pass" << path;
+        return;
+      }
+    }
 
-//  }
+    // Block and chunk indices of the chunks that may land in each tile
+    QVector< QVector< QPair<int, int> > > bins(columns * rows);
+    if(visibility.isNull() && !rayCast)
+    {
+      // Pixel of a projected coordinate, clamped to just outside the image
+      auto pixel = [](double v, int size)
+      {
+        return int(std::floor(qBound(-1.0, v, double(size))));
+      };
 
+      for(int b = 0; b < blocks.count(); ++b)
+      {
+        const QVector<PointCloud::Chunk> &chunks = blocks.at(b).chunks();
+        for(int c = 0; c < chunks.count(); ++c)
+        {
+          // Chunks reaching behind the camera may land anywhere
+          QPointF first(0, 0);
+          QPointF last(imageSize.width(), imageSize.height());
+          projectBox(krt, chunks.at(c).bounds, voxelSize/2.0, &first, &last);
+
+          // Voxel centers round to the nearest pixel
+          int left = qMax(0, pixel(first.x(), imageSize.width()));
+          int top = qMax(0, pixel(first.y(), imageSize.height()));
+          int right = qMin(imageSize.width() - 1,
+                           pixel(last.x(), imageSize.width()) + 1);
+          int bottom = qMin(imageSize.height() - 1,
+                            pixel(last.y(), imageSize.height()) + 1);
+          if(left > right || top > bottom) continue;
+
+          for(int ty = top / tileSize; ty <= bottom / tileSize; ++ty)
+            for(int tx = left / tileSize; tx <= right / tileSize; ++tx)
+              bins[ty * columns + tx].push_back(qMakePair(b, c));
+        }
+      }
+    }
+
+    QList< QSharedPointer<BitMaskWriter> > writers;
+    for(int s = 0; s < suns.count(); ++s)
+    {
+      QString path = maskPath(cameraPath, s);
+      QSharedPointer<BitMaskWriter> writer(new BitMaskWriter);
+      if(!writer->open(path, imageSize, packBits))
+      {
+        qWarning() << "Failed saving mask" << path;
+        return;
+      }
+      writers.push_back(writer);
+    }
+
+    const QVector3D empty(qInf(), qInf(), qInf());
+    for(int ty = 0; ty < rows; ++ty)
+    {
+      const int top = ty * tileSize;
+      const int height = qMin(tileSize, imageSize.height() - top);
+
+      // Masks of the row of tiles for each sun, each with its own words.
+      // Take pointer before threads start so the masks are not detached.
+      QVector<BitMask> bandMasks;
+      for(int s = 0; s < suns.count(); ++s)
+        bandMasks.push_back(BitMask(imageSize.width(), height));
+      BitMask *masks = bandMasks.data();
+
+      parallelFor(columns, 1, [&](int begin, int end)
+      {
+        for(int tx = begin; tx < end; ++tx)
+        {
+          const QPoint origin(tx * tileSize, top);
+          const int width = qMin(tileSize, imageSize.width() - origin.x());
+          Array2D<QVector3D> positions(width, height);
+          positions.fill(empty);
+
+          if(!visibility.isNull())
+          {
+            for(int y = 0; y < height; ++y)
+              for(int x = 0; x < width; ++x)
+                positions(x, y) = visibility.position(origin.x() + x,
+                                                      origin.y() + y);
+          }
+          else if(rayCast)
+          {
+            for(int y = 0; y < height; ++y)
+            {
+              for(int x = 0; x < width; ++x)
+              {
+                Ray ray(krt.position(), krt.directionThroughPixel(
+                          QPointF(origin.x() + x, origin.y() + y)));
+
+                // Save 3D position of first voxel hit through pixel
+                QVector3D hit;
+                if(occupancy.intersect(ray, 0.0, qInf(), 0, &hit))
+                  positions(x, y) = hit;
+              }
+            }
+          }
+
+          // Bins are empty unless voxels are rendered
+          for(const QPair<int, int>& bin: bins.at(ty * columns + tx))
+          {
+            const PointCloud &block = blocks.at(bin.first);
+            block.forEach(block.chunks().at(bin.second),
+                          [&](int, const QVector3D& point)
+            {
+              renderVoxelPosition(krtCamera, Cube(point, voxelSize/2.0),
+                                  positions, 0, -1, origin);
+            });
+          }
+
+          for(int s = 0; s < suns.count(); ++s)
+          {
+            for(int y = 0; y < height; ++y)
+            {
+              for(int x = 0; x < width; ++x)
+              {
+                if(positions(x, y) != empty && inShadow(s, positions(x, y)))
+                  masks[s].setBit(origin.x() + x, y);
+              }
+            }
+          }
+        }
+      });
+
+      for(int s = 0; s < suns.count(); ++s)
+        writers.at(s)->write(bandMasks.at(s));
+    }
+
+    for(int s = 0; s < suns.count(); ++s)
+    {
+      QString path = maskPath(cameraPath, s);
+      if(sunBatch || cameraBatch) qDebug() << "Saving" << path;
+
+      if(!writers.at(s)->close()) qWarning() << "Failed saving mask" << path;
+    }
+  };
+
+  // Renders positions visible from a camera, then writes a shadow mask for
+  // each sun position.  Sun depth maps are shared by all cameras.
+  auto renderCamera = [&](const QString& cameraPath)
+  {
+    KRtCamera krt = KRtCamera::load(cameraPath);
+    if(krt.isNull())
+    {
+      qWarning() << "Failed loading camera" << cameraPath;
+      return;
+    }
+
+    krt = krt.scaled(cameraScale);
+
+    if(tileSize > 0)
+    {
+      renderCameraTiles(krt, cameraPath);
+      return;
+    }
+
+    Camera krtCamera(krt);
+
+    // For each voxel, determine visibility from camera
+    Array2D<QVector3D> positionArray(krtCamera.imagePlaneSize());
+    positionArray.fill(QVector3D(qInf(), qInf(), qInf()));
+
+    // Point index per pixel; only kept for saving the camera pass
+    Array2D<int> indexArray;
+    if(!saveVisibilityPath.isEmpty() && !rayCast)
+      indexArray = Array2D<int>(positionArray.size());
+
+    if(!loadVisibilityPath.isEmpty())
+    {
+      QString path = visibilityPath(loadVisibilityPath, cameraPath,
+                                    cameraBatch);
+      VisibilityBuffer visibility = VisibilityBuffer::load(path);
+      if(visibility.isNull() || visibility.size() != positionArray.size())
+      {
+        qWarning() << "Failed loading camera pass" << path;
+        return;
+      }
+
+      positionArray = visibility.positions();
+    }
+    else if(rayCast)
+    {
+      if(!cameraBatch) qDebug() << "Casting voxel positions...";
+
+      // Rows of pixels are cast in parallel
+      parallelFor(positionArray.height(), 1, [&](int begin, int end)
+      {
+        for(int py = begin; py < end; ++py)
+        {
+          for(int px = 0; px < positionArray.width(); ++px)
+          {
+            Ray ray(krt.position(),
+                    krt.directionThroughPixel(QPointF(px, py)));
+
+            // Save 3D position of first voxel hit through pixel
+            QVector3D hit;
+            if(occupancy.intersect(ray, 0.0, qInf(), 0, &hit))
+              positionArray(px, py) = hit;
+          }
+        }
+      });
+    }
+    else
+    {
+      if(!cameraBatch) qDebug() << "Rendering voxel positions...";
+
+      // Concurrent cameras would interleave their progress output, and
+      // blocks of a streamed cloud each restart their indices.  The single
+      // block is the whole cloud, also when read from blockPath.
+      QScopedPointer<TextProgress> positionProgress;
+      if(!cameraBatch && blocks.count() == 1 && !streaming)
+      {
+        positionProgress.reset(new TextProgress(blocks.first().count(),
+                                                100));
+      }
+
+      // The nearest position per pixel is kept, so memory is bounded by the
+      // image whether or not the cloud is streamed.  Indices of later blocks
+      // follow on from earlier ones.
+      int blockStart = 0;
+      forEachBlock([&](const PointCloud& block)
+      {
+        // For each chunk of voxels that may be in view
+        for(const PointCloud::Chunk& chunk: block.chunks())
+        {
+          if(!isBoxVisible(krt, chunk.bounds, voxelSize/2.0)) continue;
+
+          block.forEach(chunk, [&](int i, const QVector3D& point)
+          {
+            Cube c(point, voxelSize/2.0);
+
+            // Save 3D position of visible voxel
+            renderVoxelPosition(krtCamera, c, positionArray,
+                                indexArray.isEmpty() ? 0 : &indexArray,
+                                blockStart + i);
+          });
+          if(positionProgress)
+            positionProgress->update(chunk.begin + chunk.count - 1);
+        }
+        blockStart += block.count();
+      });
+    }
+
+    // Save camera pass for reuse by later runs
+    if(!saveVisibilityPath.isEmpty() && loadVisibilityPath.isEmpty())
+    {
+      QString path = visibilityPath(saveVisibilityPath, cameraPath,
+                                    cameraBatch);
+      outputs.write(path, [=]()
+      {
+        return VisibilityBuffer::save(path, positionArray, indexArray,
+                                      krtCamera, min, max, sceneHash,
+                                      voxelSize);
+      });
+    }
+
+    if(!cameraBatch) qDebug() << "Generating shadow mask...";
+
+    // The camera positions are reused for every sun position
+    for(int s = 0; s < suns.count(); ++s)
+    {
+      BitMask shadowMask = generateShadowMask(positionArray,
+                                              [&](const QVector3D& position3d)
+      {
+        return inShadow(s, position3d);
+      });
+
+      QString path = maskPath(cameraPath, s);
+      if(sunBatch || cameraBatch) qDebug() << "Saving" << path;
+
+      outputs.save(shadowMask, path, packBits);
+
+      // Masks for other biases can be thresholded from the margins later
+      if(!saveMarginsPath.isEmpty())
+      {
+        MarginMap margins(positionArray.size());
+        const QVector3D empty(qInf(), qInf(), qInf());
+        parallelFor(positionArray.height(), 1, [&](int begin, int end)
+        {
+          for(int y = begin; y < end; ++y)
+          {
+            for(int x = 0; x < positionArray.width(); ++x)
+            {
+              const QVector3D &position3d = positionArray(x, y);
+              margins(x, y) = position3d == empty
+                  ? float(qQNaN()) : shadowMargin(s, position3d);
+            }
+          }
+        });
+
+        QString marginsPath = marginPath(cameraPath, s);
+        outputs.write(marginsPath, [margins, marginsPath]()
+        {
+          return margins.save(marginsPath);
+        });
+      }
+    }
+  };
+
+  // Concurrent cameras and binned tiles share the loaded blocks, so a
+  // background load that no pass consumed yet must finish first
+  if((cameraBatch || tileSize > 0) && !streaming && !blockPath.isEmpty())
+    forEachBlock([](const PointCloud&) { });
+
+  if(cameraBatch)
+  {
+
+    // Cameras render concurrently; each mask is written as it completes
+    QtConcurrent::blockingMap(cameraPaths, renderCamera);
+  }
+  else
+  {
+    renderCamera(cameraPaths.first());
+  }
+
+  int failures = outputs.waitForFinished();
+  if(failures > 0)
+  {
+    qCritical() << "Failed saving" << failures << "outputs";
+    return EXIT_FAILURE;
+  }
+
+  qDebug() << "done";
 
   QTimer::singleShot(0, &a, &QCoreApplication::quit);
   return a.exec();
@@ -1,6 +1,13 @@
 # QVector3D and QMatrix classes require gui modules
 QT += gui
 
+# Parallel passes use the global thread pool
+QT += concurrent
+
+# Compressed point clouds are read with zlib and zstd; PNG masks are
+# deflated with zlib
+LIBS += -lz -lzstd
+
 # Create command line program
 CONFIG += c++11 console
 
@@ -10,26 +17,54 @@ CONFIG -= app_bundle
 TARGET = depthShadowMask
 
 HEADERS += Array2D.h \
+           BitMask.h \
+           BitMaskWriter.h \
+           BlockQueue.h \
            Box.h \
            Camera.h \
            Cube.h \
+           Decompressor.h \
+           DepthMapCache.h \
+           DepthWriter.h \
            KRtCamera.h \
+           LASData.h \
+           MarginMap.h \
+           OccupancyGrid.h \
            OptionParser.h \
+           OutputQueue.h \
+           ParallelFor.h \
            PLYData.h \
+           PLYHeader.h \
+           PointCloud.h \
            Ray.h \
            rply.h \
            StreamUtilities.h \
+           SunPosition.h \
            TextProgress.h \
+           VisibilityBuffer.h \
            VoxelPixelArea.h
 
-SOURCES += Box.cpp \
+SOURCES += BitMask.cpp \
+           BitMaskWriter.cpp \
+           Box.cpp \
            Camera.cpp \
            Cube.cpp \
+           Decompressor.cpp \
+           DepthMapCache.cpp \
+           DepthWriter.cpp \
            depthShadowMask.cpp \
            KRtCamera.cpp \
+           LASData.cpp \
+           MarginMap.cpp \
+           OccupancyGrid.cpp \
            OptionParser.cpp \
+           OutputQueue.cpp \
            PLYData.cpp \
+           PLYHeader.cpp \
+           PointCloud.cpp \
            rply.c \
            StreamUtilities.cpp \
+           SunPosition.cpp \
            TextProgress.cpp \
+           VisibilityBuffer.cpp \
            VoxelPixelArea.cpp